@@ -0,0 +1,157 @@
+/*
+ * Host-side benchmark of getUpdates reply parsing: the former path with
+ * json_scanf_array_elem() and a json_scanf() call per field against
+ * mgos_telegram_parse_updates() from src/mgos_telegram_parse.c.
+ *
+ * Build against frozen (https://github.com/cesanta/frozen):
+ *   cc -O2 -Iinclude -Isrc -I<frozen> bench/parse_bench.c src/mgos_telegram_parse.c \
+ *     <frozen>/frozen.c -o parse_bench
+ *   ./parse_bench [iterations]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#define MGOS_EVENT_BASE(a, b, c) ((a) << 24 | (b) << 16 | (c) << 8)
+#include "mgos_telegram_parse.h"
+
+struct update {
+  uint32_t update_id;
+  uint32_t message_id;
+  int64_t chat_id;
+  uint64_t user_id;
+  char *query_id;
+  char *data;
+};
+
+static const char *UPDATE_MESSAGE =
+  "{\"update_id\":%u,\"message\":{\"message_id\":%u,\"from\":{\"id\":123456789,\"is_bot\":false,"
+  "\"first_name\":\"Name\",\"username\":\"user\",\"language_code\":\"en\"},\"chat\":{\"id\":123456789,"
+  "\"first_name\":\"Name\",\"username\":\"user\",\"type\":\"private\"},\"date\":1700000000,"
+  "\"text\":\"/status\",\"entities\":[{\"offset\":0,\"length\":7,\"type\":\"bot_command\"}]}}";
+
+static const char *UPDATE_CALLBACK =
+  "{\"update_id\":%u,\"callback_query\":{\"id\":\"4382bfdwdsb323b2d9\",\"from\":{\"id\":123456789,"
+  "\"is_bot\":false,\"first_name\":\"Name\"},\"message\":{\"message_id\":%u,\"chat\":{\"id\":123456789,"
+  "\"type\":\"private\"},\"date\":1700000000,\"text\":\"Menu\"},\"chat_instance\":\"-1234\",\"data\":\"/light on\"}}";
+
+static char *make_reply(int count) {
+  size_t size = 64 + (size_t) count * 640;
+  char *json = (char *) malloc(size);
+  int len = snprintf(json, size, "{\"ok\":true,\"result\":[");
+  for (int i = 0; i < count; i++) {
+    if (i > 0) json[len++] = ',';
+    len += snprintf(json + len, size - len, (i % 2) ? UPDATE_CALLBACK : UPDATE_MESSAGE, 1000 + i, 10 + i);
+  }
+  snprintf(json + len, size - len, "]}");
+  return json;
+}
+
+static void update_clear(struct update *u) {
+  free(u->query_id);
+  free(u->data);
+  memset(u, 0, sizeof(*u));
+}
+
+
+// Former path: every field re-tokenizes the update, every element re-tokenizes the reply
+static int parse_scanf(const char *json, int len) {
+  struct json_token t;
+  struct update u;
+  int count = 0;
+  memset(&u, 0, sizeof(u));
+  for (int i = 0; json_scanf_array_elem(json, len, ".result", i, &t) > 0; i++) {
+    json_scanf(t.ptr, t.len, "{update_id: %u}", &u.update_id);
+    json_scanf(t.ptr, t.len, "{message: {message_id: %u}}", &u.message_id);
+    json_scanf(t.ptr, t.len, "{callback_query: {id: %Q}}", &u.query_id);
+    if (u.message_id > 0) {
+      json_scanf(t.ptr, t.len, "{message: {chat: {id: %lld}}}", &u.chat_id);
+      json_scanf(t.ptr, t.len, "{message: {from: {id: %llu}}}", &u.user_id);
+      json_scanf(t.ptr, t.len, "{message: {text: %Q}}", &u.data);
+    }
+    else if (u.query_id != NULL) {
+      json_scanf(t.ptr, t.len, "{callback_query: {from: {id: %llu}}}", &u.user_id);
+      json_scanf(t.ptr, t.len, "{callback_query: {message: {chat: {id: %lld}}}}", &u.chat_id);
+      json_scanf(t.ptr, t.len, "{callback_query: {message: {message_id: %u}}}", &u.message_id);
+      json_scanf(t.ptr, t.len, "{callback_query: {data: %Q}}", &u.data);
+    }
+    if (u.update_id > 0) count++;
+    update_clear(&u);
+  }
+  return count;
+}
+
+
+// Current path: the parser of the library, one walk of the reply
+struct mgos_telegram_update *mgos_telegram_update_alloc(void) {
+  struct mgos_telegram_update *update = (struct mgos_telegram_update *) calloc(1, sizeof(*update));
+  update->type = NO_TYPE;
+  return update;
+}
+
+void mgos_telegram_update_free(struct mgos_telegram_update *update) {
+  free(update->data);
+  free(update->query_id);
+  free(update);
+}
+
+void mgos_telegram_update_set_str(struct mgos_telegram_update *update, char **dest, const struct json_token *t, const char *str) {
+  if (t != NULL) {
+    mgos_telegram_json_to_str(t, dest, NULL, 0);
+    return;
+  }
+  free(*dest);
+  *dest = strdup(str);
+  (void) update;
+}
+
+static int parse_walk(const char *json, int len) {
+  struct update_queue updates = STAILQ_HEAD_INITIALIZER(updates);
+  int count = mgos_telegram_parse_updates(json, (size_t) len, true, &updates);
+  while (!STAILQ_EMPTY(&updates)) {
+    struct mgos_telegram_update *update = STAILQ_FIRST(&updates);
+    STAILQ_REMOVE_HEAD(&updates, next);
+    mgos_telegram_update_free(update);
+  }
+  return count;
+}
+
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double run(int (*parse)(const char *, int), const char *json, int len, int expect, int iterations) {
+  double start = now_us();
+  for (int i = 0; i < iterations; i++) {
+    if (parse(json, len) != expect) {
+      fprintf(stderr, "parser returned wrong update count\n");
+      exit(1);
+    }
+  }
+  return (now_us() - start) / iterations;
+}
+
+int main(int argc, char **argv) {
+  int iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+  if (iterations <= 0) iterations = 2000;
+  const int batches[] = {1, 10, 100};
+
+  printf("%8s %8s %14s %14s %8s\n", "updates", "bytes", "json_scanf,us", "json_walk,us", "ratio");
+  for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+    char *json = make_reply(batches[i]);
+    int len = (int) strlen(json);
+    double scanf_us = run(parse_scanf, json, len, batches[i], iterations);
+    double walk_us = run(parse_walk, json, len, batches[i], iterations);
+    printf("%8d %8d %14.2f %14.2f %7.1fx\n", batches[i], len, scanf_us, walk_us, scanf_us / walk_us);
+    free(json);
+  }
+  return 0;
+}
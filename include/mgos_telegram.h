@@ -36,6 +36,13 @@ enum mgos_telegram_request_method {
   CUSTOM_METHOD
 };
 
+enum mgos_telegram_priority {
+  PRIORITY_DEFAULT = -1,  // Chosen by method: getMe - control, edits and callback answers - interactive, others - bulk
+  PRIORITY_CONTROL,
+  PRIORITY_INTERACTIVE,
+  PRIORITY_BULK
+};
+
 enum mgos_telegram_update_type {
   NO_TYPE,
   MESSAGE,
@@ -48,6 +55,7 @@ struct mgos_telegram_response {
   char *description;
   int message_id;
   int64_t chat_id;
+  int retry_after;
   enum mgos_telegram_request_method method;
 };
 
@@ -58,10 +66,88 @@ struct mgos_telegram_update {
   uint64_t user_id;
   int64_t chat_id;
   char *data;
+  const char *args;
   char *query_id;
+  double queued_at;
   STAILQ_ENTRY(mgos_telegram_update) next;
 };
 
+struct mgos_telegram_stats {
+  int request_queue_depth;
+  int request_queue_peak;
+  uint32_t requests_enqueued;
+  uint32_t requests_dropped;  // Rejected because request queue was full
+  uint32_t requests_sent;     // Completed with a reply from the server
+  int update_queue_depth;
+  int update_queue_peak;
+  uint32_t updates_enqueued;
+  uint32_t updates_dropped;   // Rejected because update queue was full
+  uint32_t updates_dispatched;
+  int pool_size;            // Max parallel request connections
+  int pool_busy;            // Connections with a request in flight
+  int pool_busy_peak;
+  uint32_t pool_dispatched; // Requests started
+  uint32_t pool_connects;   // New connections opened
+  uint32_t pool_reuses;     // Requests sent over an idle keep-alive connection
+  uint32_t pool_waits;      // Times a ready request had to wait for a free connection
+  uint32_t prealloc_misses; // Heap allocations made while telegram.prealloc is on
+  uint32_t throttle_global; // Requests held by the global rate limit
+  uint32_t throttle_chat;   // Requests held by the per-chat or per-group rate limit
+  uint32_t throttle_429;    // Requests re-queued after "Too Many Requests" reply
+  uint32_t requests_coalesced; // Messages appended to a queued message to the same chat
+  uint32_t requests_superseded; // Queued edits replaced by a newer edit of the same message
+  uint32_t requests_preempted;  // Requests queued ahead of lower priority ones
+  uint32_t retries;            // Requests and polls sent again after a connection failure
+  uint32_t retries_exhausted;  // Requests completed with an error after telegram.retry_max retries
+  uint32_t escalations;        // Full reconnects after telegram.escalate_after failures in a row
+  uint32_t token_checks;       // getMe requests sent to test the token
+  uint32_t fast_reconnects;    // Reconnects which trusted the token validated before
+  uint32_t webhook_updates;    // Updates received by the webhook listener
+  uint32_t webhook_rejected;   // Webhook requests refused: wrong secret or update queue full
+  int poll_buffer_peak;        // Largest single update buffered while parsing getUpdates reply, bytes
+  uint32_t poll_suspended_ms;  // Time polling waited for free slots in the update queue
+  uint32_t refetches_avoided;  // Updates which did not fit the update queue and were held instead of downloading them again
+  uint32_t offset_writes;      // Update offset saves to telegram.offset_file
+  uint32_t upload_bytes;       // File bytes streamed by mgos_telegram_send_file()
+  int spool_depth;             // Requests waiting in telegram.spool_file
+  uint32_t spooled;            // Requests written to the spool
+  uint32_t spool_evicted;      // Oldest spooled requests overwritten by new ones
+  uint32_t spool_drained;      // Spooled requests moved to the request queue
+  uint32_t spool_hdr_writes;   // Writes of the spool header, batched by telegram.spool_flush_ms
+};
+
+#define MGOS_TELEGRAM_HIST_BUCKETS 16
+#define MGOS_TELEGRAM_ERROR_SLOTS 8
+
+struct mgos_telegram_histogram {
+  uint32_t count;
+  uint32_t sum_ms;
+  uint32_t max_ms;
+  uint32_t buckets[MGOS_TELEGRAM_HIST_BUCKETS]; // Bucket i counts times below 2^i ms, the last one the rest
+};
+
+struct mgos_telegram_method_metrics {
+  struct mgos_telegram_histogram connect;    // New connection until connected, TLS handshake included
+  struct mgos_telegram_histogram first_byte; // Request sent until the first bytes of the reply
+  struct mgos_telegram_histogram total;      // Request sent until the whole reply
+};
+
+struct mgos_telegram_error_count {
+  int code;
+  uint32_t count;
+};
+
+struct mgos_telegram_metrics {
+  struct mgos_telegram_method_metrics methods[CUSTOM_METHOD + 1]; // Indexed by request method
+  struct mgos_telegram_histogram request_wait; // Request queued until sent
+  struct mgos_telegram_histogram update_wait;  // Update queued until dispatched
+  struct mgos_telegram_histogram poll_cycle;   // getUpdates sent until its connection closed
+  uint32_t bytes_sent;
+  uint32_t bytes_received;
+  struct mgos_telegram_error_count errors[MGOS_TELEGRAM_ERROR_SLOTS]; // Replies by error_code
+  uint32_t errors_other;                       // Error codes which didn't get a slot
+};
+
 typedef void (*mgos_telegram_cb_t)(void *ev_data, void *userdata);
 void mgos_telegram_subscribe(const char *data, mgos_telegram_cb_t callback, void *userdata);
 
@@ -70,6 +156,7 @@ void mgos_telegram_send_message_json(const char *json);
 
 void mgos_telegram_send_message_with_callback(int64_t chat_id, const char *text, mgos_telegram_cb_t callback, void *userdata);
 void mgos_telegram_send_message_json_with_callback(const char *json, mgos_telegram_cb_t callback, void *userdata);
+void mgos_telegram_send_message_json_with_priority(const char *json, enum mgos_telegram_priority priority, mgos_telegram_cb_t callback, void *userdata);
 
 void mgos_telegram_edit_message_text(int64_t chat_id, uint32_t message_id, const char *text);
 void mgos_telegram_edit_message_text_json(const char *json);
@@ -79,6 +166,28 @@ void mgos_telegram_answer_callback_query_json(const char *json);
 
 void mgos_telegram_execute_custom_method(const char *method, const char *json);
 void mgos_telegram_execute_custom_method_with_callback(const char *method, const char *json, mgos_telegram_cb_t callback, void *userdata);
+void mgos_telegram_execute_custom_method_with_priority(const char *method, const char *json, enum mgos_telegram_priority priority, mgos_telegram_cb_t callback, void *userdata);
+
+// Streams file from the filesystem as multipart/form-data, e.g. method "sendDocument", field "document"
+bool mgos_telegram_send_file(int64_t chat_id, const char *method, const char *field, const char *path, const char *caption, mgos_telegram_cb_t callback, void *userdata);
+// Same with options in JSON object {method, field, caption}, defaults are "sendDocument" and "document"
+bool mgos_telegram_send_file_json(int64_t chat_id, const char *path, const char *json, mgos_telegram_cb_t callback, void *userdata);
+
+// Placeholders: %I - int64_t, %D - int, %F - double, %Q - string, %B - bool, %% - percent sign
+int mgos_telegram_template_register(const char *method, const char *skeleton);
+bool mgos_telegram_send_template(int id, ...);
+bool mgos_telegram_send_template_with_callback(int id, mgos_telegram_cb_t callback, void *userdata, ...);
+bool mgos_telegram_send_template_json(int id, const char *args_json);
+bool mgos_telegram_send_template_json_with_callback(int id, const char *args_json, mgos_telegram_cb_t callback, void *userdata);
+
+bool mgos_telegram_acl_add(int64_t user_id);
+bool mgos_telegram_acl_remove(int64_t user_id);
+void mgos_telegram_acl_reload(void);
+
+const struct mgos_telegram_stats *mgos_telegram_get_stats(void);
+const struct mgos_telegram_metrics *mgos_telegram_get_metrics(void);
+const char *mgos_telegram_get_metrics_json(void);
+void mgos_telegram_reset_metrics(void);
 
 #ifdef __cplusplus
 }
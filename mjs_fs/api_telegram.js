@@ -23,6 +23,7 @@ let TGB = {
   _smc: ffi('void *mgos_telegram_send_message_with_callback(int, char *, void (*)(void *, userdata), userdata)'),
   _smj: ffi('void *mgos_telegram_send_message_json(char *)'),
   _smjc: ffi('void *mgos_telegram_send_message_json_with_callback(char *, void (*)(void *, userdata), userdata)'),
+  _smjp: ffi('void *mgos_telegram_send_message_json_with_priority(char *, int, void (*)(void *, userdata), userdata)'),
 
   _um: ffi('void *mgos_telegram_edit_message_text(int, int, char *)'),
   _umj: ffi('void *mgos_telegram_edit_message_text_json(char *)'),
@@ -32,9 +33,24 @@ let TGB = {
 
   _cmj: ffi('void *mgos_telegram_execute_custom_method(char *, char *)'),
   _cmjc: ffi('void *mgos_telegram_execute_custom_method_with_callback(char *, char *, void (*)(void *, userdata), userdata)'),
+  _cmjp: ffi('void *mgos_telegram_execute_custom_method_with_priority(char *, char *, int, void (*)(void *, userdata), userdata)'),
+
+  _sfj: ffi('bool mgos_telegram_send_file_json(int, char *, char *, void (*)(void *, userdata), userdata)'),
+
+  _tr: ffi('int mgos_telegram_template_register(char *, char *)'),
+  _st: ffi('bool mgos_telegram_send_template_json(int, char *)'),
+  _stc: ffi('bool mgos_telegram_send_template_json_with_callback(int, char *, void (*)(void *, userdata), userdata)'),
+
+  _aa: ffi('bool mgos_telegram_acl_add(int)'),
+  _ar: ffi('bool mgos_telegram_acl_remove(int)'),
+  _al: ffi('void mgos_telegram_acl_reload()'),
 
   _ud: ffi('void *get_update_descr(void *)'),
   _rd: ffi('void *get_response_descr(void *)'),
+  _gs: ffi('void *mgos_telegram_get_stats()'),
+  _sd: ffi('void *get_stats_descr(void *)'),
+  _gm: ffi('char *mgos_telegram_get_metrics_json()'),
+  _rm: ffi('void mgos_telegram_reset_metrics()'),
 
   subscribe: function(data, cb, ud){
     return this._sb(data, cb, ud);
@@ -51,6 +67,9 @@ let TGB = {
   send_js_cb: function(js_obj, cb, ud){
     return this._smjc(JSON.stringify(js_obj), cb, ud);
   },
+  send_js_prio: function(js_obj, prio, cb, ud){
+    return this._smjp(JSON.stringify(js_obj), prio, cb, ud);
+  },
   update: function(chat_id, message_id, text){
     return this._um(chat_id, message_id, text);
   },
@@ -69,6 +88,30 @@ let TGB = {
   custom_cb: function(method, js_obj, cb, ud){
     return this._cmjc(method, JSON.stringify(js_obj), cb, ud);
   },
+  template: function(method, skeleton){
+    return this._tr(method, skeleton);
+  },
+  send_template: function(id, args){
+    return this._st(id, JSON.stringify(args));
+  },
+  send_template_cb: function(id, args, cb, ud){
+    return this._stc(id, JSON.stringify(args), cb, ud);
+  },
+  custom_prio: function(method, js_obj, prio, cb, ud){
+    return this._cmjp(method, JSON.stringify(js_obj), prio, cb, ud);
+  },
+  send_file: function(chat_id, method, field, path, caption, cb, ud){
+    return this._sfj(chat_id, path, JSON.stringify({method: method, field: field, caption: caption}), cb, ud);
+  },
+  acl_add: function(user_id){
+    return this._aa(user_id);
+  },
+  acl_remove: function(user_id){
+    return this._ar(user_id);
+  },
+  acl_reload: function(){
+    return this._al();
+  },
   parse_update: function(ptr){
     let u = s2o(ptr, this._ud(ptr));
     return u;
@@ -77,10 +120,28 @@ let TGB = {
     let r = s2o(ptr, this._rd(ptr));
     return r;
   },
+  stats: function(){
+    let ptr = this._gs();
+    if (!ptr) return null;
+    return s2o(ptr, this._sd(ptr));
+  },
+  metrics: function(){
+    let js = this._gm();
+    if (!js) return null;
+    return JSON.parse(js);
+  },
+  reset_metrics: function(){
+    this._rm();
+  },
   // EVENTS
   DISCONNECTED: tgb_bn + 0,
   CONNECTED:    tgb_bn + 1,
   RECONNECTED:  tgb_bn + 2,
+  // PRIORITIES
+  PRIO_DEFAULT: -1,
+  PRIO_CONTROL: 0,
+  PRIO_INTERACTIVE: 1,
+  PRIO_BULK: 2,
   // UPDATES  
   MESSAGE: 1,
   CALLBACK_QUERY: 2
@@ -16,48 +16,242 @@
 
 #include "common/cs_dbg.h"
 #include "common/str_util.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include "mgos_sys_config.h"
 #include "mgos_mongoose.h"
 #include "mgos_net.h"
+#include "mgos_system.h"
 #include "mgos_timers.h"
 #include "mgos_telegram.h"
+#include "mgos_telegram_parse.h"
 
 #ifdef MGOS_HAVE_MJS
 #include "mjs.h"
 #endif
 
+#ifdef MGOS_HAVE_RPC_COMMON
+#include "mg_rpc.h"
+#include "mgos_rpc.h"
+#endif
+
 #define LIB_NAME "TELEGRAM"
+#define ROUTES_NUM 32
+#define TEMPLATE_ARGS_MAX 16
+#define RATE_CHATS_NUM 8
+#define MESSAGE_TEXT_MAX 4096
+#define CONTROL_QUEUE_LEN 2
+#define PRIORITY_NUM 3
+#define UPLOAD_BOUNDARY "----mgosTelegramUpload7MA4YWxkTrZu0gW"
+#define UPLOAD_CHUNK_SIZE 512
+#define SPOOL_MAGIC 0x4c4f5053
+#define UPDATE_FIELDS_SIZE 512
 
 struct mgos_telegram_subscription {
   char *data;
+  size_t len;
+  uint32_t hash;
   mgos_telegram_cb_t callback;
   void *userdata;
   SLIST_ENTRY(mgos_telegram_subscription) next;
 };
 
+struct mgos_telegram_conn;
+
+struct mgos_telegram_request_cb {
+  mgos_telegram_cb_t callback;
+  void *userdata;
+  SLIST_ENTRY(mgos_telegram_request_cb) next;
+};
+
 struct mgos_telegram_request {
   enum mgos_telegram_request_method method;
   char *custom_method;
   char *json;
+  int64_t chat_id;
+  uint32_t message_id;
+  enum mgos_telegram_priority priority;
   mgos_telegram_cb_t callback;
   void *userdata;
   struct mgos_telegram_response *response;
+  struct mgos_telegram_conn *conn;
+  bool pooled;
+  bool throttled;
+  bool pool_waited;   // Already counted in pool_waits
+  double not_before;
+  bool coalesce;
+  size_t text_len;
+  int retries;
+  SLIST_HEAD(request_cbs, mgos_telegram_request_cb) merged_cbs;
+  char *file;         // File sent as multipart/form-data, json holds the parts before it
+  FILE *upload;
+  size_t upload_left;
+  double queued_at;
+  double sent_at;
+  bool first_byte;
+  char *body_buf;
+  char method_buf[32];
   STAILQ_ENTRY(mgos_telegram_request) next;
 };
 
+struct mgos_telegram_update_slot {
+  struct mgos_telegram_update update;
+  char *text_buf;
+  char query_buf[32];
+};
+
+struct mgos_telegram_template_part {
+  uint16_t offset;  // Literal JSON before the placeholder
+  uint16_t len;
+  char type;        // Placeholder type: I, D, F, Q, B or 0 for the tail
+};
+
+struct mgos_telegram_template {
+  enum mgos_telegram_request_method method;
+  char *custom_method;
+  char *literals;
+  struct mgos_telegram_template_part *parts;
+  int parts_num;
+  int chat_id_arg;  // Placeholder which holds chat_id, or -1
+};
+
+struct mgos_telegram_template_arg {
+  int64_t num;
+  double dbl;
+  const char *str;
+  const char *raw;  // Escaped JSON token, when arguments come from JSON
+  int raw_len;
+};
+
+struct mgos_telegram_rate_bucket {
+  int64_t chat_id;
+  double tokens;
+  double stamp;
+};
+
+// Spool file is the header followed by a ring of records: uint16_t length, then
+// method, priority, custom method name length, custom method name and JSON body
+struct mgos_telegram_spool_hdr {
+  uint32_t magic;
+  uint32_t head;  // Oldest record
+  uint32_t tail;  // Next record goes here
+  uint32_t used;
+  uint32_t count;
+};
+
+struct mgos_telegram_spool_cb {
+  uint32_t seq;
+  enum mgos_telegram_request_method method;
+  mgos_telegram_cb_t callback;
+  void *userdata;
+  STAILQ_ENTRY(mgos_telegram_spool_cb) next;
+};
+
+struct mgos_telegram_conn {
+  struct mg_connection *nc;
+  struct mgos_telegram_request *request;
+  double connect_at;
+};
+
+enum mgos_telegram_stream_state {
+  STREAM_HEADERS,
+  STREAM_BODY,
+  STREAM_CHUNK_SIZE,
+  STREAM_CHUNK_DATA,
+  STREAM_CHUNK_END,
+  STREAM_DONE,
+};
+
+struct mgos_telegram_poll_stream {
+  enum mgos_telegram_stream_state state;
+  int64_t body_left;  // Body bytes still expected, -1 if body ends with the connection
+  size_t chunk_left;
+  int depth;          // JSON nesting level of the scanned byte
+  bool in_result;     // Inside .result array
+  bool in_str;
+  bool esc;
+  bool in_update;     // Update object is being copied to buf
+  struct mbuf buf;
+  int count;
+};
+
 struct mgos_telegram {
   uint32_t update_id;
+  uint32_t offset_saved;
+  mgos_timer_id offset_timer;
+  int spool_count;
+  struct mgos_telegram_spool_hdr spool_hdr;
+  uint32_t spool_saved_used;  // Used bytes as the header on flash says
+  uint32_t spool_unsaved;     // Bytes pushed after the last header write
+  uint32_t spool_seq;         // Sequence number of the oldest record
+  bool spool_dirty;
+  mgos_timer_id spool_timer;
+  STAILQ_HEAD(spool_cbs, mgos_telegram_spool_cb) spool_cbs;
+  struct spool_cbs spool_cbs_lost;
   bool auth_token_tested;
+  bool auth_token_valid;
+  int token_checks;
+  mgos_timer_id token_timer;
   const struct mgos_config_telegram *cfg;
+  char *acl_src;
+  int64_t *acl;
+  int acl_len;
+  int acl_size;
+  int64_t *acl_runtime; // Ids added by mgos_telegram_acl_add(), kept when telegram.acl changes
+  int acl_runtime_len;
+  int acl_runtime_size;
+  char *server_addr;
+  char *server_host;
+  bool server_ssl;
+  char *http_prefix;
+  char *http_host;
   bool poll_connected;
-  bool out_connected;
   struct mg_connection *nc_poll;
-  struct mg_connection *nc_out;
-  SLIST_HEAD(subscriptions, mgos_telegram_subscription) subscriptions;
-  STAILQ_HEAD(update_queue, mgos_telegram_update) update_queue;
+  struct mgos_telegram_conn *conns;
+  int conns_num;
+  int conns_max;
+  struct mgos_telegram_stats stats;
+  struct mgos_telegram_request *request_slab;
+  struct mgos_telegram_response *response_slab;
+  char *body_arena;
+  size_t body_size;
+  int request_slab_num;
+  STAILQ_HEAD(request_free, mgos_telegram_request) request_free;
+  struct mgos_telegram_update_slot *update_slab;
+  char *text_arena;
+  size_t text_size;
+  int update_slab_num;
+  STAILQ_HEAD(update_free, mgos_telegram_update) update_free;
+  struct mgos_telegram_template *templates;
+  int templates_num;
+  SLIST_HEAD(subscriptions, mgos_telegram_subscription) routes[ROUTES_NUM];
+  struct subscriptions prefix_routes;
+  struct mgos_telegram_subscription *wildcard_route;
+  int subscriptions_num;
+  struct update_queue update_queue;
+  struct update_queue update_pending;
   STAILQ_HEAD(request_queue, mgos_telegram_request) request_queue;
-  mgos_timer_id update_queue_timer;
-  mgos_timer_id request_queue_timer;
+  int request_class_depth[PRIORITY_NUM];
+  bool update_dispatch_pending;
+  bool request_pump_pending;
+  struct mgos_telegram_rate_bucket rate_global;
+  struct mgos_telegram_rate_bucket rate_chats[RATE_CHATS_NUM];
+  mgos_timer_id rate_timer;
+  double rate_timer_at;
+  int fail_streak;
+  int poll_retries;
+  bool poll_replied;
+  bool poll_conflict;
+  mgos_timer_id poll_timer;
+  double poll_started_at;
+  bool poll_suspended;
+  double poll_suspended_at;
+  struct mgos_telegram_poll_stream poll_stream;
+  bool webhook_set;
+  struct mgos_telegram_metrics metrics;
+  char *metrics_json;
 };
 
 struct mgos_telegram *tg = NULL;
@@ -65,36 +259,147 @@ struct mgos_telegram *tg = NULL;
 #ifdef MGOS_HAVE_MJS
 const struct mjs_c_struct_member *get_update_descr(void *ptr);
 const struct mjs_c_struct_member *get_response_descr(void *ptr);
+const struct mjs_c_struct_member *get_stats_descr(void *ptr);
 #endif
 
+static void mgos_telegram_update_dispatch(struct mgos_telegram_update *update);
 static void mgos_telegram_update_queue_handler(void *userdata);
+static void mgos_telegram_update_queue_kick(void);
 static void mgos_telegram_request_queue_handler(void *userdata);
+static void mgos_telegram_request_queue_kick(void);
 
 struct mgos_telegram_request *mgos_telegram_request_alloc(void);
 static void mgos_telegram_request_free(struct mgos_telegram_request *request);
 
 struct mgos_telegram_update *mgos_telegram_update_alloc(void);
-static void mgos_telegram_update_free(struct mgos_telegram_update *update);
+void mgos_telegram_update_free(struct mgos_telegram_update *update);
 
 struct mgos_telegram_response *mgos_telegram_response_alloc(void);
 static void mgos_telegram_response_free(struct mgos_telegram_response *response);
 
-static bool mgos_telegram_is_request_queue_overflow();
+static void mgos_telegram_slabs_init(struct mgos_telegram *tg);
+static struct mgos_telegram_update_slot *mgos_telegram_update_slot(struct mgos_telegram_update *update);
+static void mgos_telegram_request_printf(struct mgos_telegram_request *request, const char *fmt, ...);
+static void mgos_telegram_request_set_json(struct mgos_telegram_request *request, const char *json);
+static void mgos_telegram_request_set_method(struct mgos_telegram_request *request, const char *method);
+
+static enum mgos_telegram_priority mgos_telegram_request_priority(const struct mgos_telegram_request *request);
+static bool mgos_telegram_is_request_queue_overflow(enum mgos_telegram_priority priority);
 static bool mgos_telegram_is_update_queue_overflow();
+static int mgos_telegram_update_queue_free_slots();
+static void mgos_telegram_request_queue_insert(struct mgos_telegram_request *request);
+static void mgos_telegram_request_queue_remove(struct mgos_telegram_request *request);
+static void mgos_telegram_update_queue_insert(struct mgos_telegram_update *update);
+static struct mgos_telegram_update *mgos_telegram_update_queue_pop(void);
+static bool mgos_telegram_request_supersede(struct mgos_telegram_request *request);
 static bool mgos_telegram_request_queue_add(struct mgos_telegram_request *request);
+static bool mgos_telegram_request_queue_push(struct mgos_telegram_request *request);
+static bool mgos_telegram_can_queue(void);
+static bool mgos_telegram_request_is_chat_head(const struct mgos_telegram_request *request);
+static bool mgos_telegram_request_coalesce(int64_t chat_id, const char *text, mgos_telegram_cb_t callback, void *userdata);
+static struct mgos_telegram_conn *mgos_telegram_conn_get_free(void);
+static double mgos_telegram_rate_refill(struct mgos_telegram_rate_bucket *bucket, int rate, double period, double now);
+static struct mgos_telegram_rate_bucket *mgos_telegram_rate_chat(int64_t chat_id);
+static double mgos_telegram_rate_check(struct mgos_telegram_request *request, double now);
+static void mgos_telegram_rate_timer_cb(void *arg);
+static void mgos_telegram_rate_timer_arm(double wait);
+static void mgos_telegram_rate_retry(struct mgos_telegram_request *request, struct http_message *hm);
+static void mgos_telegram_conn_update_stats(void);
+static double mgos_telegram_retry_backoff(int attempt);
+static bool mgos_telegram_retry_escalate(void);
+static void mgos_telegram_request_complete(struct mgos_telegram_request *request, struct http_message *hm);
+static void mgos_telegram_request_failed(struct mgos_telegram_request *request);
+static void mgos_telegram_poll_retry_cb(void *arg);
+static void mgos_telegram_poll_failed(void);
+static int mgos_telegram_acl_cmp(const void *a, const void *b);
+static int mgos_telegram_acl_find(int64_t user_id, bool *found);
+static void mgos_telegram_acl_append(struct mgos_telegram *tg, int64_t user_id);
+static void mgos_telegram_acl_walk_cb(void *data, const char *name, size_t name_len, const char *path, const struct json_token *t);
+static void mgos_telegram_acl_build(struct mgos_telegram *tg);
+static bool mgos_telegram_acl_insert(int64_t user_id);
+static void mgos_telegram_acl_sync(void);
 static bool mgos_telegram_check_user_access(uint64_t user_id);
-struct mgos_telegram_subscription *mgos_telegram_subscription_search(const char *data);
+static uint32_t mgos_telegram_route_hash(const char *key, size_t len);
+static size_t mgos_telegram_route_key(const char *data, const char **args);
+struct mgos_telegram_subscription *mgos_telegram_subscription_search(const char *data, const char **args);
+static struct mgos_telegram_subscription *mgos_telegram_subscription_find(const char *data);
 
-static void mgos_telegram_parse_update(void *source, void *dest, uint32_t *id);
+static void mgos_telegram_response_walk_cb(void *data, const char *name, size_t name_len, const char *path, const struct json_token *t);
 static void mgos_telegram_parse_response(void *source, void *dest);
 
+static bool mgos_telegram_template_is_chat_id(const char *lit, size_t len);
+static bool mgos_telegram_template_compile(struct mgos_telegram_template *tpl, const char *skeleton);
+static int mgos_telegram_template_print(struct json_out *out, const struct mgos_telegram_template *tpl, const struct mgos_telegram_template_arg *args);
+static char *mgos_telegram_template_asprintf(const struct mgos_telegram_template *tpl, const struct mgos_telegram_template_arg *args, char *buf, size_t size);
+static void mgos_telegram_template_args_va(const struct mgos_telegram_template *tpl, struct mgos_telegram_template_arg *args, va_list ap);
+static void mgos_telegram_template_args_walk_cb(void *data, const char *name, size_t name_len, const char *path, const struct json_token *t);
+static bool mgos_telegram_template_send(int id, const struct mgos_telegram_template_arg *args, mgos_telegram_cb_t callback, void *userdata);
+static bool mgos_telegram_template_check_id(int id);
+
+static void mgos_telegram_poll_stream_reset(void);
+static void mgos_telegram_poll_stream_update(const char *json, size_t len);
+static void mgos_telegram_poll_stream_append(const char *p, size_t n);
+static void mgos_telegram_poll_stream_scan(const char *p, size_t n);
+static bool mgos_telegram_poll_stream_headers(struct mg_connection *nc);
+static void mgos_telegram_poll_stream_body(struct mbuf *io);
+static void mgos_telegram_poll_stream_done(struct mg_connection *nc);
+
+static const char *mgos_telegram_request_method_name(const struct mgos_telegram_request *request);
+static struct mg_connection *mgos_telegram_http_connect(mg_event_handler_t handler, void *userdata, bool http);
+static void mgos_telegram_http_write_request(struct mg_connection *nc, const char *method, const char *body);
+static bool mgos_telegram_http_poll_wanted(void);
 static void mgos_telegram_http_poll_once();
-static void mgos_telegram_http_send_request(struct mgos_telegram_request *request);
+static void mgos_telegram_http_poll_resume(void);
+static void mgos_telegram_http_send_request(struct mgos_telegram_conn *conn, struct mgos_telegram_request *request);
 static void mgos_telegram_http_update_handler(struct mg_connection *nc, int ev, void *ev_data, void *userdata);
 static void mgos_telegram_http_request_handler(struct mg_connection *nc, int ev, void *ev_data, void *userdata);
 
+static void mgos_telegram_upload_write(struct mg_connection *nc, const char *method, struct mgos_telegram_request *request);
+static void mgos_telegram_upload_pump(struct mg_connection *nc, struct mgos_telegram_request *request);
+static bool mgos_telegram_upload_close(struct mgos_telegram_request *request);
+
+static void mgos_telegram_offset_set(uint32_t update_id);
+static void mgos_telegram_offset_flush(void);
+static void mgos_telegram_offset_flush_cb(void *arg);
+static void mgos_telegram_offset_reboot_cb(int ev, void *ev_data, void *userdata);
+static void mgos_telegram_offset_restore(struct mgos_telegram *tg);
+
+static bool mgos_telegram_spool_accepts(const struct mgos_telegram_request *request);
+static uint32_t mgos_telegram_spool_area(void);
+static void mgos_telegram_spool_cb_notify(void);
+static void mgos_telegram_spool_cb_take(uint32_t seq, struct mgos_telegram_request *request);
+static void mgos_telegram_spool_reset(void);
+static bool mgos_telegram_spool_write_hdr(FILE *fp);
+static FILE *mgos_telegram_spool_open(void);
+static bool mgos_telegram_spool_io(FILE *fp, uint32_t pos, void *buf, size_t len, bool write);
+static void mgos_telegram_spool_close(FILE *fp, bool changed);
+static void mgos_telegram_spool_flush(void);
+static void mgos_telegram_spool_flush_cb(void *arg);
+static void mgos_telegram_spool_reboot_cb(int ev, void *ev_data, void *userdata);
+static bool mgos_telegram_spool_push(const struct mgos_telegram_request *request);
+static void mgos_telegram_spool_drain(void);
+static void mgos_telegram_spool_init(struct mgos_telegram *tg);
+
+static void mgos_telegram_metrics_hist(struct mgos_telegram_histogram *hist, double seconds);
+static void mgos_telegram_metrics_error(int code);
+static void mgos_telegram_metrics_io(int ev, void *ev_data);
+static int mgos_telegram_metrics_print_hist(struct json_out *out, va_list *ap);
+static int mgos_telegram_metrics_print(struct json_out *out, va_list *ap);
+#ifdef MGOS_HAVE_RPC_COMMON
+static void mgos_telegram_rpc_stats_handler(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args);
+#endif
+
+static void mgos_telegram_webhook_cb(void *ev_data, void *userdata);
+static void mgos_telegram_webhook_request(const char *method);
+static void mgos_telegram_webhook_handler(struct mg_connection *nc, int ev, void *ev_data, void *userdata);
+static void mgos_telegram_webhook_listen(struct mgos_telegram *tg);
+
 static void mgos_telegram_close_all_connections(void);
 static void mgos_telegram_check_token(void);
+static void mgos_telegram_check_token_cb(void *userdata);
+static void mgos_telegram_token_rejected(void);
+static void mgos_telegram_set_active(void);
+static bool mgos_telegram_parse_server(struct mgos_telegram *tg, const char *server);
 static void mgos_telegram_network_cb(int ev, void *ev_data, void *userdata);
 static void mgos_telegram_connection_cb(void *ev_data, void *userdata);
 bool mgos_telegram_check_config(const struct mgos_config_telegram *cfg);
@@ -109,6 +414,7 @@ static const struct mjs_c_struct_member update_descr_message[] = {
   {"chat_id", offsetof(struct mgos_telegram_update, chat_id), MJS_STRUCT_FIELD_TYPE_INT, NULL},
   {"user_id", offsetof(struct mgos_telegram_update, user_id), MJS_STRUCT_FIELD_TYPE_INT, NULL},
   {"data", offsetof(struct mgos_telegram_update, data), MJS_STRUCT_FIELD_TYPE_CHAR_PTR, NULL},
+  {"args", offsetof(struct mgos_telegram_update, args), MJS_STRUCT_FIELD_TYPE_CHAR_PTR, NULL},
   {NULL, 0, MJS_STRUCT_FIELD_TYPE_INVALID, NULL},
 };
 
@@ -117,6 +423,7 @@ static const struct mjs_c_struct_member update_descr_callback_query[] = {
   {"type", offsetof(struct mgos_telegram_update, type), MJS_STRUCT_FIELD_TYPE_INT, NULL},
   {"callback_query_id", offsetof(struct mgos_telegram_update, query_id), MJS_STRUCT_FIELD_TYPE_CHAR_PTR, NULL},
   {"data", offsetof(struct mgos_telegram_update, data), MJS_STRUCT_FIELD_TYPE_CHAR_PTR, NULL},
+  {"args", offsetof(struct mgos_telegram_update, args), MJS_STRUCT_FIELD_TYPE_CHAR_PTR, NULL},
   {"message_id", offsetof(struct mgos_telegram_update, message_id), MJS_STRUCT_FIELD_TYPE_INT, NULL},
   {"chat_id", offsetof(struct mgos_telegram_update, chat_id), MJS_STRUCT_FIELD_TYPE_INT, NULL},
   {"user_id", offsetof(struct mgos_telegram_update, user_id), MJS_STRUCT_FIELD_TYPE_INT, NULL},
@@ -149,6 +456,7 @@ static const struct mjs_c_struct_member response_descr_error[] = {
   {"ok", offsetof(struct mgos_telegram_response, ok), MJS_STRUCT_FIELD_TYPE_BOOL, NULL},
   {"error_code", offsetof(struct mgos_telegram_response, error_code), MJS_STRUCT_FIELD_TYPE_INT, NULL},  
   {"description", offsetof(struct mgos_telegram_response, description), MJS_STRUCT_FIELD_TYPE_CHAR_PTR, NULL},
+  {"retry_after", offsetof(struct mgos_telegram_response, retry_after), MJS_STRUCT_FIELD_TYPE_INT, NULL},
   {NULL, 0, MJS_STRUCT_FIELD_TYPE_INVALID, NULL},
 };
 
@@ -177,15 +485,62 @@ const struct mjs_c_struct_member *get_response_descr(void *ptr) {
       break;
   }
 }
+
+
+static const struct mjs_c_struct_member stats_descr[] = {
+  {"request_queue_depth", offsetof(struct mgos_telegram_stats, request_queue_depth), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"request_queue_peak", offsetof(struct mgos_telegram_stats, request_queue_peak), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"requests_enqueued", offsetof(struct mgos_telegram_stats, requests_enqueued), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"requests_dropped", offsetof(struct mgos_telegram_stats, requests_dropped), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"requests_sent", offsetof(struct mgos_telegram_stats, requests_sent), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"update_queue_depth", offsetof(struct mgos_telegram_stats, update_queue_depth), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"update_queue_peak", offsetof(struct mgos_telegram_stats, update_queue_peak), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"updates_enqueued", offsetof(struct mgos_telegram_stats, updates_enqueued), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"updates_dropped", offsetof(struct mgos_telegram_stats, updates_dropped), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"updates_dispatched", offsetof(struct mgos_telegram_stats, updates_dispatched), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"pool_size", offsetof(struct mgos_telegram_stats, pool_size), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"pool_busy", offsetof(struct mgos_telegram_stats, pool_busy), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"pool_busy_peak", offsetof(struct mgos_telegram_stats, pool_busy_peak), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"pool_dispatched", offsetof(struct mgos_telegram_stats, pool_dispatched), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"pool_connects", offsetof(struct mgos_telegram_stats, pool_connects), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"pool_reuses", offsetof(struct mgos_telegram_stats, pool_reuses), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"pool_waits", offsetof(struct mgos_telegram_stats, pool_waits), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"prealloc_misses", offsetof(struct mgos_telegram_stats, prealloc_misses), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"throttle_global", offsetof(struct mgos_telegram_stats, throttle_global), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"throttle_chat", offsetof(struct mgos_telegram_stats, throttle_chat), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"throttle_429", offsetof(struct mgos_telegram_stats, throttle_429), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"requests_coalesced", offsetof(struct mgos_telegram_stats, requests_coalesced), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"requests_superseded", offsetof(struct mgos_telegram_stats, requests_superseded), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"requests_preempted", offsetof(struct mgos_telegram_stats, requests_preempted), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"retries", offsetof(struct mgos_telegram_stats, retries), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"retries_exhausted", offsetof(struct mgos_telegram_stats, retries_exhausted), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"escalations", offsetof(struct mgos_telegram_stats, escalations), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"token_checks", offsetof(struct mgos_telegram_stats, token_checks), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"fast_reconnects", offsetof(struct mgos_telegram_stats, fast_reconnects), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"webhook_updates", offsetof(struct mgos_telegram_stats, webhook_updates), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"webhook_rejected", offsetof(struct mgos_telegram_stats, webhook_rejected), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"poll_buffer_peak", offsetof(struct mgos_telegram_stats, poll_buffer_peak), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"poll_suspended_ms", offsetof(struct mgos_telegram_stats, poll_suspended_ms), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"refetches_avoided", offsetof(struct mgos_telegram_stats, refetches_avoided), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"offset_writes", offsetof(struct mgos_telegram_stats, offset_writes), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"upload_bytes", offsetof(struct mgos_telegram_stats, upload_bytes), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"spool_depth", offsetof(struct mgos_telegram_stats, spool_depth), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"spooled", offsetof(struct mgos_telegram_stats, spooled), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"spool_evicted", offsetof(struct mgos_telegram_stats, spool_evicted), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"spool_drained", offsetof(struct mgos_telegram_stats, spool_drained), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {"spool_hdr_writes", offsetof(struct mgos_telegram_stats, spool_hdr_writes), MJS_STRUCT_FIELD_TYPE_INT, NULL},
+  {NULL, 0, MJS_STRUCT_FIELD_TYPE_INVALID, NULL},
+};
+
+const struct mjs_c_struct_member *get_stats_descr(void *ptr) {
+  (void) ptr;
+  return stats_descr;
+}
 #endif
 
 // TELEGRAM QUEUE HANDLERS
-static void mgos_telegram_update_queue_handler(void *userdata) {
+static void mgos_telegram_update_dispatch(struct mgos_telegram_update *update) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-
-  if (STAILQ_EMPTY(&tg->update_queue)) return;
-
-  struct mgos_telegram_update *update = STAILQ_FIRST(&tg->update_queue);
   struct mgos_telegram_subscription *subscription;
 
   switch (update->type) {
@@ -202,7 +557,7 @@ static void mgos_telegram_update_queue_handler(void *userdata) {
       //Check permissions for user_id in access list
       if (!mgos_telegram_check_user_access(update->user_id)) break;
       //Search for subscription
-      subscription = mgos_telegram_subscription_search(update->data);
+      subscription = mgos_telegram_subscription_search(update->data, &update->args);
       //If subscribed invoke callback stored in subscription
       if (subscription) {
         LOG(LL_DEBUG, ("%s ->> %s %s", LIB_NAME, "Subscription found:", update->data));
@@ -217,7 +572,7 @@ static void mgos_telegram_update_queue_handler(void *userdata) {
       //Check permissions for user_id in access list
       if (!mgos_telegram_check_user_access(update->user_id)) break;
       //Search for subscription
-      subscription = mgos_telegram_subscription_search(update->data);
+      subscription = mgos_telegram_subscription_search(update->data, &update->args);
 	    //If subscribed call callback stored in subscription
       if (subscription) {
         LOG(LL_DEBUG, ("%s ->> %s  %s", LIB_NAME, "Subscription found:", update->data));
@@ -230,26 +585,131 @@ static void mgos_telegram_update_queue_handler(void *userdata) {
       break;
     }
   }
+}
 
-  STAILQ_REMOVE(&tg->update_queue, update, mgos_telegram_update, next);
-  mgos_telegram_update_free(update);
+static void mgos_telegram_update_queue_handler(void *userdata) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  tg->update_dispatch_pending = false;
+  if (!tg->auth_token_tested) return;
+
+  // Dispatch up to telegram.dispatch_budget updates, then yield to the event loop
+  int budget = tg->cfg->dispatch_budget > 0 ? tg->cfg->dispatch_budget : 1;
+  struct mgos_telegram_update *update;
+
+  while (budget-- > 0 && (update = mgos_telegram_update_queue_pop()) != NULL) {
+    tg->stats.updates_dispatched++;
+    mgos_telegram_metrics_hist(&tg->metrics.update_wait, mgos_uptime() - update->queued_at);
+    mgos_telegram_update_dispatch(update);
+    mgos_telegram_update_free(update);
+  }
 
+  if (tg->poll_suspended) mgos_telegram_http_poll_resume();
+  mgos_telegram_update_queue_kick();
   (void) userdata;
 }
 
+static void mgos_telegram_update_queue_kick(void) {
+  // Defer dispatching via event loop so callbacks never run inside mongoose handlers
+  if (tg->update_dispatch_pending || STAILQ_EMPTY(&tg->update_queue)) return;
+  tg->update_dispatch_pending = mgos_invoke_cb(mgos_telegram_update_queue_handler, NULL, false);
+}
+
 static void mgos_telegram_request_queue_handler(void *userdata) {
-  if (STAILQ_EMPTY(&tg->request_queue) || tg->out_connected) return;
+  tg->request_pump_pending = false;
+  if (!tg->auth_token_tested) return;
+  if (tg->spool_count > 0) mgos_telegram_spool_drain();
+  if (STAILQ_EMPTY(&tg->request_queue)) return;
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  struct mgos_telegram_request *request = STAILQ_FIRST(&tg->request_queue);
-  mgos_telegram_http_send_request(request);
+
+  // Start every request which is not in flight, is not waiting behind one for the same chat
+  // and is allowed by rate limits. Held requests are retried by a timer when a token is due
+  struct mgos_telegram_request *request;
+  struct mgos_telegram_conn *conn;
+  double now = mgos_uptime();
+  double wait = 0, delay;
+  STAILQ_FOREACH(request, &tg->request_queue, next) {
+    if (request->conn != NULL || !mgos_telegram_request_is_chat_head(request)) continue;
+    conn = mgos_telegram_conn_get_free();
+    if (conn == NULL) {
+      if (!request->pool_waited) {
+        request->pool_waited = true;
+        tg->stats.pool_waits++;
+      }
+      break;
+    }
+    delay = mgos_telegram_rate_check(request, now);
+    if (delay > 0) {
+      if (wait == 0 || delay < wait) wait = delay;
+      continue;
+    }
+    mgos_telegram_http_send_request(conn, request);
+  }
+  if (wait > 0) mgos_telegram_rate_timer_arm(wait);
   (void) userdata;
 }
 
+static void mgos_telegram_request_queue_kick(void) {
+  // Start next request as soon as a connection is free, no polling timer involved
+  if (tg->request_pump_pending || (STAILQ_EMPTY(&tg->request_queue) && tg->spool_count == 0)) return;
+  tg->request_pump_pending = mgos_invoke_cb(mgos_telegram_request_queue_handler, NULL, false);
+}
+
 
 // TELEGRAM QUEUE SERVICE FN
+// With telegram.prealloc requests, responses and updates come from slabs sized by
+// queue lengths, bodies and texts live in fixed-size arenas. Heap is only used
+// when a slab is exhausted or a body doesn't fit its slot (see prealloc_misses).
+static void mgos_telegram_slabs_init(struct mgos_telegram *tg) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  STAILQ_INIT(&tg->request_free);
+  STAILQ_INIT(&tg->update_free);
+  if (!tg->cfg->prealloc) return;
+
+  size_t body_size = tg->body_size = tg->cfg->prealloc_body_size > 0 ? tg->cfg->prealloc_body_size : 512;
+  size_t text_size = tg->text_size = tg->cfg->prealloc_text_size > 0 ? tg->cfg->prealloc_text_size : 256;
+
+  // Slots for every priority class and one extra for GET_ME which bypasses the queue limit
+  tg->request_slab_num = (tg->cfg->request_queue_len > 0 ? tg->cfg->request_queue_len : 1) +
+    (tg->cfg->interactive_queue_len > 0 ? tg->cfg->interactive_queue_len : 0) + CONTROL_QUEUE_LEN + 1;
+  tg->request_slab = (struct mgos_telegram_request *) calloc(tg->request_slab_num, sizeof(*tg->request_slab));
+  tg->response_slab = (struct mgos_telegram_response *) calloc(tg->request_slab_num, sizeof(*tg->response_slab));
+  tg->body_arena = (char *) malloc(tg->request_slab_num * body_size);
+  for (int i = 0; i < tg->request_slab_num; i++) {
+    struct mgos_telegram_request *request = &tg->request_slab[i];
+    request->pooled = true;
+    request->response = &tg->response_slab[i];
+    request->body_buf = tg->body_arena + i * body_size;
+    STAILQ_INSERT_TAIL(&tg->request_free, request, next);
+  }
+
+  tg->update_slab_num = tg->cfg->update_queue_len > 0 ? tg->cfg->update_queue_len : 1;
+  tg->update_slab = (struct mgos_telegram_update_slot *) calloc(tg->update_slab_num, sizeof(*tg->update_slab));
+  tg->text_arena = (char *) malloc(tg->update_slab_num * text_size);
+  for (int i = 0; i < tg->update_slab_num; i++) {
+    struct mgos_telegram_update_slot *slot = &tg->update_slab[i];
+    slot->text_buf = tg->text_arena + i * text_size;
+    STAILQ_INSERT_TAIL(&tg->update_free, &slot->update, next);
+  }
+  LOG(LL_INFO, ("%s ->> Preallocated %d request and %d update slots", LIB_NAME, tg->request_slab_num, tg->update_slab_num));
+}
+
+static struct mgos_telegram_update_slot *mgos_telegram_update_slot(struct mgos_telegram_update *update) {
+  struct mgos_telegram_update_slot *slot = (struct mgos_telegram_update_slot *) update;
+  if (tg->update_slab == NULL || slot < tg->update_slab || slot >= tg->update_slab + tg->update_slab_num) return NULL;
+  return slot;
+}
+
 struct mgos_telegram_update *mgos_telegram_update_alloc(void) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  struct mgos_telegram_update *update = calloc(1, sizeof(*update));
+  struct mgos_telegram_update *update = STAILQ_FIRST(&tg->update_free);
+  if (update != NULL) {
+    STAILQ_REMOVE_HEAD(&tg->update_free, next);
+    memset(update, 0, sizeof(*update));
+  }
+  else {
+    if (tg->update_slab != NULL) tg->stats.prealloc_misses++;
+    update = calloc(1, sizeof(*update));
+  }
   update->type = NO_TYPE;
   update->update_id = 0;
   update->data = NULL;
@@ -257,18 +717,55 @@ struct mgos_telegram_update *mgos_telegram_update_alloc(void) {
   return update;
 }
 
-static void mgos_telegram_update_free(struct mgos_telegram_update *update) {
+void mgos_telegram_update_free(struct mgos_telegram_update *update) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  if (update->data != NULL) free(update->data);
-  if (update->query_id != NULL) free(update->query_id);
-  free(update);
+  struct mgos_telegram_update_slot *slot = mgos_telegram_update_slot(update);
+  if (update->data != NULL && (slot == NULL || update->data != slot->text_buf)) free(update->data);
+  if (update->query_id != NULL && (slot == NULL || update->query_id != slot->query_buf)) free(update->query_id);
+  if (slot != NULL) STAILQ_INSERT_HEAD(&tg->update_free, update, next);
+  else free(update);
+}
+
+void mgos_telegram_update_set_str(struct mgos_telegram_update *update, char **dest, const struct json_token *t, const char *str) {
+  struct mgos_telegram_update_slot *slot = mgos_telegram_update_slot(update);
+  char *buf = NULL;
+  size_t size = 0;
+  if (slot != NULL) {
+    buf = (dest == &update->data) ? slot->text_buf : slot->query_buf;
+    size = (dest == &update->data) ? tg->text_size : sizeof(slot->query_buf);
+  }
+  if (t != NULL) {
+    mgos_telegram_json_to_str(t, dest, buf, size);
+    return;
+  }
+  if (*dest != NULL && *dest != buf) free(*dest);
+  if (buf != NULL && strlen(str) < size) {
+    strcpy(buf, str);
+    *dest = buf;
+  }
+  else *dest = strdup(str);
 }
 
 struct mgos_telegram_request *mgos_telegram_request_alloc(void) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  struct mgos_telegram_request *request = calloc(1, sizeof(*request));
-  request->response = mgos_telegram_response_alloc();
+  struct mgos_telegram_request *request = STAILQ_FIRST(&tg->request_free);
+  if (request != NULL) {
+    STAILQ_REMOVE_HEAD(&tg->request_free, next);
+    struct mgos_telegram_response *response = request->response;
+    char *body_buf = request->body_buf;
+    memset(request, 0, sizeof(*request));
+    memset(response, 0, sizeof(*response));
+    request->pooled = true;
+    request->response = response;
+    request->body_buf = body_buf;
+  }
+  else {
+    if (tg->request_slab != NULL) tg->stats.prealloc_misses++;
+    request = calloc(1, sizeof(*request));
+    request->response = mgos_telegram_response_alloc();
+  }
   request->method = NO_METHOD;
+  request->priority = PRIORITY_DEFAULT;
   request->json = NULL;
   request->custom_method = NULL;
   return request;
@@ -276,12 +773,65 @@ struct mgos_telegram_request *mgos_telegram_request_alloc(void) {
 
 static void mgos_telegram_request_free(struct mgos_telegram_request *request) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (request->json != NULL && request->json != request->body_buf) free(request->json);
+  if (request->custom_method != NULL && request->custom_method != request->method_buf) free(request->custom_method);
+  if (request->file != NULL) free(request->file);
+  if (request->upload != NULL) fclose(request->upload);
+  struct mgos_telegram_request_cb *cb;
+  while ((cb = SLIST_FIRST(&request->merged_cbs)) != NULL) {
+    SLIST_REMOVE_HEAD(&request->merged_cbs, next);
+    free(cb);
+  }
+  if (request->pooled) {
+    if (request->response->description != NULL) free(request->response->description);
+    STAILQ_INSERT_HEAD(&tg->request_free, request, next);
+    return;
+  }
   mgos_telegram_response_free(request->response);
-  if (request->json != NULL) free(request->json);
-  if (request->custom_method != NULL) free(request->custom_method);
   free(request);
 }
 
+static void mgos_telegram_request_printf(struct mgos_telegram_request *request, const char *fmt, ...) {
+  va_list ap;
+  if (request->body_buf != NULL) {
+    size_t size = tg->body_size;
+    struct json_out out = JSON_OUT_BUF(request->body_buf, size);
+    va_start(ap, fmt);
+    int len = json_vprintf(&out, fmt, ap);
+    va_end(ap);
+    if (len >= 0 && (size_t) len < size) {
+      request->json = request->body_buf;
+      return;
+    }
+    tg->stats.prealloc_misses++;
+  }
+  va_start(ap, fmt);
+  request->json = json_vasprintf(fmt, ap);
+  va_end(ap);
+}
+
+static void mgos_telegram_request_set_json(struct mgos_telegram_request *request, const char *json) {
+  size_t len = strlen(json);
+  if (request->body_buf != NULL) {
+    if (len < tg->body_size) {
+      memcpy(request->body_buf, json, len + 1);
+      request->json = request->body_buf;
+      return;
+    }
+    tg->stats.prealloc_misses++;
+  }
+  request->json = (char *) malloc(len + 1);
+  memcpy(request->json, json, len + 1);
+}
+
+static void mgos_telegram_request_set_method(struct mgos_telegram_request *request, const char *method) {
+  if (request->pooled && strlen(method) < sizeof(request->method_buf)) {
+    strcpy(request->method_buf, method);
+    request->custom_method = request->method_buf;
+  }
+  else request->custom_method = strdup(method);
+}
+
 struct mgos_telegram_response *mgos_telegram_response_alloc(void) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
   struct mgos_telegram_response *response = calloc(1, sizeof(*response));
@@ -296,329 +846,1922 @@ static void mgos_telegram_response_free(struct mgos_telegram_response *response)
 }
 
 
-static bool mgos_telegram_is_request_queue_overflow() {
-  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+// Queue depth is tracked by counters, so checks don't walk the queues
+// Request queue is ordered by priority class: control, interactive, bulk.
+// Every class has its own capacity, so bulk sends never take slots of interactive replies
+static enum mgos_telegram_priority mgos_telegram_request_priority(const struct mgos_telegram_request *request) {
+  if (request->priority > PRIORITY_DEFAULT && request->priority < PRIORITY_NUM) return request->priority;
+  switch (request->method) {
+    case GET_ME:                return PRIORITY_CONTROL;
+    case EDIT_MESSAGE_TEXT:
+    case ANSWER_CALLBACK_QUERY: return PRIORITY_INTERACTIVE;
+    default:                    return PRIORITY_BULK;
+  }
+}
 
-  bool overflow = false;
-  size_t qlen = 0;      
-  struct mgos_telegram_request *request;
+static bool mgos_telegram_is_request_queue_overflow(enum mgos_telegram_priority priority) {
+  int len;
+  switch (priority) {
+    case PRIORITY_CONTROL:     len = CONTROL_QUEUE_LEN; break;
+    case PRIORITY_INTERACTIVE: len = tg->cfg->interactive_queue_len; break;
+    default:                   len = tg->cfg->request_queue_len; break;
+  }
+  return tg->request_class_depth[priority] >= len;
+}
+
+static bool mgos_telegram_is_update_queue_overflow() {
+  return tg->stats.update_queue_depth >= tg->cfg->update_queue_len;
+}
 
-  STAILQ_FOREACH(request, &tg->request_queue, next) { qlen++; }
-  if (qlen >= tg->cfg->request_queue_len) overflow = true;
+static int mgos_telegram_update_queue_free_slots() {
+  int depth = tg->stats.update_queue_depth;
+  return depth < tg->cfg->update_queue_len ? tg->cfg->update_queue_len - depth : 0;
+}
 
-  return overflow;
+static void mgos_telegram_request_queue_insert(struct mgos_telegram_request *request) {
+  // Insert after the last request of the same or higher priority
+  struct mgos_telegram_request *r, *prev = NULL;
+  request->queued_at = mgos_uptime();
+  request->priority = mgos_telegram_request_priority(request);
+  STAILQ_FOREACH(r, &tg->request_queue, next) {
+    if (r->priority > request->priority) break;
+    prev = r;
+  }
+  // Order of one chat wins over priority: request never overtakes a queued request to its chat
+  if (request->chat_id != 0) {
+    for (struct mgos_telegram_request *c = r; c != NULL; c = STAILQ_NEXT(c, next)) {
+      if (c->chat_id != request->chat_id) continue;
+      prev = c;
+      r = STAILQ_NEXT(c, next);
+    }
+  }
+  if (r != NULL) tg->stats.requests_preempted++;
+  if (prev == NULL) STAILQ_INSERT_HEAD(&tg->request_queue, request, next);
+  else STAILQ_INSERT_AFTER(&tg->request_queue, prev, request, next);
+  tg->request_class_depth[request->priority]++;
+  tg->stats.requests_enqueued++;
+  if (++tg->stats.request_queue_depth > tg->stats.request_queue_peak) {
+    tg->stats.request_queue_peak = tg->stats.request_queue_depth;
+  }
 }
 
-static bool mgos_telegram_is_update_queue_overflow() {
-  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+static void mgos_telegram_request_queue_remove(struct mgos_telegram_request *request) {
+  STAILQ_REMOVE(&tg->request_queue, request, mgos_telegram_request, next);
+  tg->request_class_depth[request->priority]--;
+  tg->stats.request_queue_depth--;
+}
 
-  bool overflow = false;
-  size_t qlen = 0;      
-  struct mgos_telegram_update *update;
+static void mgos_telegram_update_queue_insert(struct mgos_telegram_update *update) {
+  update->queued_at = mgos_uptime();
+  STAILQ_INSERT_TAIL(&tg->update_queue, update, next);
+  tg->stats.updates_enqueued++;
+  if (++tg->stats.update_queue_depth > tg->stats.update_queue_peak) {
+    tg->stats.update_queue_peak = tg->stats.update_queue_depth;
+  }
+}
 
-  STAILQ_FOREACH(update, &tg->update_queue, next) { qlen++; }
-  if (qlen >= tg->cfg->update_queue_len) overflow = true;
-  
-  return overflow;
+static struct mgos_telegram_update *mgos_telegram_update_queue_pop(void) {
+  struct mgos_telegram_update *update = STAILQ_FIRST(&tg->update_queue);
+  if (update == NULL) return NULL;
+  STAILQ_REMOVE_HEAD(&tg->update_queue, next);
+  tg->stats.update_queue_depth--;
+  // Freed slot is taken by an update held when the queue was full
+  struct mgos_telegram_update *held = STAILQ_FIRST(&tg->update_pending);
+  if (held != NULL) {
+    STAILQ_REMOVE_HEAD(&tg->update_pending, next);
+    mgos_telegram_update_queue_insert(held);
+  }
+  return update;
+}
+
+// Edit of a message replaces the queued edit of the same message which is not sent yet,
+// so only the latest text is transmitted
+static bool mgos_telegram_request_supersede(struct mgos_telegram_request *request) {
+  if (request->method != EDIT_MESSAGE_TEXT || request->message_id == 0) return false;
+  struct mgos_telegram_request *r;
+  STAILQ_FOREACH(r, &tg->request_queue, next) {
+    if (r->method != EDIT_MESSAGE_TEXT || r->chat_id != request->chat_id || r->message_id != request->message_id) continue;
+    // Edit with a callback is completed as usual, the callback would be lost otherwise
+    if (r->conn != NULL || r->callback != NULL) continue;
+    request->not_before = r->not_before;
+    request->throttled = r->throttled;
+    request->priority = r->priority;
+    request->queued_at = mgos_uptime();
+    STAILQ_INSERT_AFTER(&tg->request_queue, r, request, next);
+    STAILQ_REMOVE(&tg->request_queue, r, mgos_telegram_request, next);
+    mgos_telegram_request_free(r);
+    tg->stats.requests_superseded++;
+    LOG(LL_DEBUG, ("%s ->> Queued edit of message %u superseded", LIB_NAME, request->message_id));
+    return true;
+  }
+  return false;
 }
 
 static bool mgos_telegram_request_queue_add(struct mgos_telegram_request *request) {
+  // Request goes to telegram.spool_file when it can't be sent now, and behind the
+  // spooled ones while there are any, so order is kept
+  if (mgos_telegram_spool_accepts(request) &&
+      (!tg->auth_token_tested || tg->spool_count > 0 ||
+       mgos_telegram_is_request_queue_overflow(mgos_telegram_request_priority(request)))) {
+    if (!mgos_telegram_spool_push(request)) {
+      tg->stats.requests_dropped++;
+      return false;
+    }
+    mgos_telegram_request_free(request);
+    mgos_telegram_request_queue_kick();
+    return true;
+  }
+  return mgos_telegram_request_queue_push(request);
+}
+
+static bool mgos_telegram_request_queue_push(struct mgos_telegram_request *request) {
   bool success = false;
-  if (!mgos_telegram_is_request_queue_overflow()) {
+  // Chat id keeps requests to the same chat in order while others run in parallel
+  if (request->json != NULL) {
+    if (request->method == EDIT_MESSAGE_TEXT && (request->chat_id == 0 || request->message_id == 0)) {
+      json_scanf(request->json, strlen(request->json), "{chat_id: %lld, message_id: %u}", &request->chat_id, &request->message_id);
+    }
+    else if (request->chat_id == 0) {
+      json_scanf(request->json, strlen(request->json), "{chat_id: %lld}", &request->chat_id);
+    }
+  }
+  if (mgos_telegram_request_supersede(request)) {
+    mgos_telegram_request_queue_kick();
+    success = true;
+  }
+  else if (!mgos_telegram_is_request_queue_overflow(mgos_telegram_request_priority(request))) {
     LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-    STAILQ_INSERT_TAIL(&tg->request_queue, request, next);
+    mgos_telegram_request_queue_insert(request);
+    mgos_telegram_request_queue_kick();
     success = true;
   }
+  else tg->stats.requests_dropped++;
   return success;
 }
 
+static bool mgos_telegram_can_queue(void) {
+  // With spool requests are accepted while the bot is offline
+  if (tg == NULL) return false;
+  return tg->auth_token_tested || (tg->cfg->spool_file != NULL && tg->cfg->spool_file[0] != '\0');
+}
 
-// TELEGRAM SERVICE FN
-static bool mgos_telegram_check_user_access(uint64_t user_id) {
-  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  bool allowed = false;
 
-  if (tg->cfg->acl == NULL) {
-    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Access list is empty, ignore update"));
-    return allowed;
+static bool mgos_telegram_request_is_chat_head(const struct mgos_telegram_request *request) {
+  if (request->chat_id == 0) return true;
+  struct mgos_telegram_request *r;
+  STAILQ_FOREACH(r, &tg->request_queue, next) {
+    if (r == request) return true;
+    if (r->chat_id == request->chat_id) return false;
   }
-  
-  struct json_token t;
-  int64_t acl_el;
+  return true;
+}
 
-  for (int i = 0; json_scanf_array_elem(tg->cfg->acl, strlen(tg->cfg->acl), "", i, &t) > 0; i++) {
-    json_scanf(t.ptr, t.len, "%llu", &acl_el);
-    if (acl_el != 0 && acl_el == user_id) {
-      allowed = true;
-      break;
-    }
+
+// With telegram.coalesce_ms plain text message waits in the queue for the window,
+// next texts to the same chat are appended to it on new lines instead of new requests
+static bool mgos_telegram_request_coalesce(int64_t chat_id, const char *text, mgos_telegram_cb_t callback, void *userdata) {
+  struct mgos_telegram_request *r, *last = NULL;
+  STAILQ_FOREACH(r, &tg->request_queue, next) {
+    if (r->chat_id == chat_id) last = r;
+  }
+  // Only the last request to the chat can take the text, so order is kept.
+  // While the spool is not empty new texts go behind the spooled ones
+  if (tg->spool_count > 0) return false;
+  size_t len = strlen(text);
+  if (last == NULL || !last->coalesce || last->conn != NULL || last->text_len + 1 + len > MESSAGE_TEXT_MAX) return false;
+  char *end = strrchr(last->json, '"');
+  char *quoted = json_asprintf("%Q", text);
+  if (end == NULL || quoted == NULL) {
+    free(quoted);
+    return false;
   }
-  
-  if (allowed) LOG(LL_DEBUG, ("%s ->> Access allowed for user_id: %llu, accept update", LIB_NAME, user_id));
-  else LOG(LL_INFO, ("%s ->> Access denied for user_id: %llu, ignore update", LIB_NAME, user_id));
 
-  return allowed;
+  // Splice "\n<escaped text>" before closing quote of the text value
+  size_t head = end - last->json;
+  size_t tail = strlen(end);
+  size_t qlen = strlen(quoted) - 2;
+  size_t size = head + 2 + qlen + tail + 1;
+  char *json = last->json;
+  if (json != last->body_buf || size > tg->body_size) {
+    if (last->body_buf != NULL) tg->stats.prealloc_misses++;
+    json = (char *) malloc(size);
+    memcpy(json, last->json, head);
+  }
+  memmove(json + head + 2 + qlen, last->json + head, tail + 1);
+  memcpy(json + head, "\\n", 2);
+  memcpy(json + head + 2, quoted + 1, qlen);
+  free(quoted);
+  if (json != last->json) {
+    if (last->json != last->body_buf) free(last->json);
+    last->json = json;
+  }
+  last->text_len += 1 + len;
+
+  // Every original callback gets the response of the merged message
+  if (callback != NULL) {
+    if (tg->request_slab != NULL) tg->stats.prealloc_misses++;
+    struct mgos_telegram_request_cb *cb = calloc(1, sizeof(*cb)), *c, *prev = NULL;
+    cb->callback = callback;
+    cb->userdata = userdata;
+    SLIST_FOREACH(c, &last->merged_cbs, next) prev = c;
+    if (prev == NULL) SLIST_INSERT_HEAD(&last->merged_cbs, cb, next);
+    else SLIST_INSERT_AFTER(prev, cb, next);
+  }
+  tg->stats.requests_coalesced++;
+  LOG(LL_DEBUG, ("%s: %s %s", LIB_NAME, "Message coalesced ->>", last->json));
+  return true;
 }
 
-struct mgos_telegram_subscription *mgos_telegram_subscription_search(const char *data) {
-  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  if (SLIST_EMPTY(&tg->subscriptions)) return NULL;
 
-  struct mgos_telegram_subscription *subscription;
-  SLIST_FOREACH(subscription, &tg->subscriptions, next) {
-    if ( strcmp(subscription->data, "*") == 0 || strcasecmp(subscription->data, data) == 0 ) {
-      return subscription;
+// TELEGRAM CONNECTION POOL FN
+static struct mgos_telegram_conn *mgos_telegram_conn_get_free(void) {
+  struct mgos_telegram_conn *empty = NULL;
+  int opened = 0;
+
+  // Prefer idle keep-alive connection, then open a new one if allowed
+  for (int i = 0; i < tg->conns_num; i++) {
+    struct mgos_telegram_conn *conn = &tg->conns[i];
+    if (conn->nc == NULL) {
+      if (empty == NULL) empty = conn;
+      continue;
     }
+    opened++;
+    if (conn->request == NULL) return conn;
   }
 
-  return NULL;
+  return opened < tg->conns_max ? empty : NULL;
 }
 
+static void mgos_telegram_conn_update_stats(void) {
+  int busy = 0;
+  for (int i = 0; i < tg->conns_num; i++) {
+    if (tg->conns[i].request != NULL) busy++;
+  }
+  tg->stats.pool_busy = busy;
+  if (busy > tg->stats.pool_busy_peak) tg->stats.pool_busy_peak = busy;
+}
 
-// TELEGRAM PARSERS
-static void mgos_telegram_parse_update(void *source, void *dest, uint32_t *update_id) {
-  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  
-  struct http_message *hm = (struct http_message *) source;
-  struct mgos_telegram_update *update = (struct mgos_telegram_update *) dest;
-  
-  struct json_token t;
-  json_scanf_array_elem(hm->body.p, hm->body.len, ".result", 0, &t);
-  json_scanf(t.ptr, t.len, "{update_id: %u}", &update->update_id);
-
-  if (update->update_id) {
-    json_scanf(t.ptr, t.len, "{message: {message_id: %u}}", &update->message_id);
-    json_scanf(t.ptr, t.len, "{callback_query: {id: %Q}}", &update->query_id);
-    if (update->message_id > 0)         update->type = MESSAGE;
-    else if (update->query_id != NULL)  update->type = CALLBACK_QUERY;
-
-    switch (update->type) {
-      case MESSAGE: {
-        json_scanf(t.ptr, t.len, "{message: {chat: {id: %lld}}}", &update->chat_id);
-        json_scanf(t.ptr, t.len, "{message: {from: {id: %llu}}}", &update->user_id);
-        json_scanf(t.ptr, t.len, "{message: {text: %Q}}", &update->data);
-        if (update->data == NULL) mg_asprintf(&update->data, 0, "Unsupported characters");
-        break;      
-      }
-      case CALLBACK_QUERY: {
-        json_scanf(t.ptr, t.len, "{callback_query: {from: {id: %llu}}}", &update->user_id);
-        json_scanf(t.ptr, t.len, "{callback_query: {message: {chat: {id: %lld}}}}", &update->chat_id);
-        json_scanf(t.ptr, t.len, "{callback_query: {message: {message_id: %u}}}", &update->message_id);
-        json_scanf(t.ptr, t.len, "{callback_query: {data: %Q}}", &update->data);
-        if (update->data == NULL) mg_asprintf(&update->data, 0, "Unsupported characters");
-        break;      
-      }
-      default: {
-        break;
-      }
+
+// TELEGRAM RATE LIMIT FN
+// Token buckets follow Bot API limits: telegram.rate_global messages per second overall,
+// telegram.rate_chat per second to a private chat and telegram.rate_group per minute to a group.
+// Buckets of recently used chats are kept in a small fixed table, the least recent is reused
+static double mgos_telegram_rate_refill(struct mgos_telegram_rate_bucket *bucket, int rate, double period, double now) {
+  // Bucket holds up to rate tokens and returns seconds left until the next token
+  if (bucket->stamp == 0) bucket->tokens = rate;
+  else {
+    bucket->tokens += (now - bucket->stamp) * rate / period;
+    if (bucket->tokens > rate) bucket->tokens = rate;
+  }
+  bucket->stamp = now;
+  return bucket->tokens >= 1 ? 0 : (1 - bucket->tokens) * period / rate;
+}
+
+static struct mgos_telegram_rate_bucket *mgos_telegram_rate_chat(int64_t chat_id) {
+  struct mgos_telegram_rate_bucket *oldest = &tg->rate_chats[0];
+  for (int i = 0; i < RATE_CHATS_NUM; i++) {
+    struct mgos_telegram_rate_bucket *bucket = &tg->rate_chats[i];
+    if (bucket->chat_id == chat_id) return bucket;
+    if (bucket->stamp < oldest->stamp) oldest = bucket;
+  }
+  // New chat takes over the tokens of the evicted one instead of a full bucket, so rotating
+  // through more than RATE_CHATS_NUM chats doesn't escape the limit. A bucket idle for its
+  // period is full anyway
+  oldest->chat_id = chat_id;
+  return oldest;
+}
+
+static double mgos_telegram_rate_check(struct mgos_telegram_request *request, double now) {
+  if (request->not_before > now) return request->not_before - now;
+  if (request->method == GET_ME) return 0;
+
+  double wait;
+  struct mgos_telegram_rate_bucket *chat = NULL;
+  if (tg->cfg->rate_global > 0) {
+    wait = mgos_telegram_rate_refill(&tg->rate_global, tg->cfg->rate_global, 1, now);
+    if (wait > 0) {
+      if (!request->throttled) tg->stats.throttle_global++;
+      request->throttled = true;
+      return wait;
+    }
+  }
+  // Negative chat id belongs to a group or a channel
+  int rate = request->chat_id < 0 ? tg->cfg->rate_group : tg->cfg->rate_chat;
+  if (request->chat_id != 0 && rate > 0) {
+    chat = mgos_telegram_rate_chat(request->chat_id);
+    wait = mgos_telegram_rate_refill(chat, rate, request->chat_id < 0 ? 60 : 1, now);
+    if (wait > 0) {
+      if (!request->throttled) tg->stats.throttle_chat++;
+      request->throttled = true;
+      return wait;
     }
   }
 
-  *update_id = update->update_id;
+  if (tg->cfg->rate_global > 0) tg->rate_global.tokens -= 1;
+  if (chat != NULL) chat->tokens -= 1;
+  request->throttled = false;
+  return 0;
 }
 
-static void mgos_telegram_parse_response(void *source, void *dest) {
-  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+static void mgos_telegram_rate_timer_cb(void *arg) {
+  tg->rate_timer = MGOS_INVALID_TIMER_ID;
+  mgos_telegram_request_queue_kick();
+  (void) arg;
+}
 
-  struct http_message *hm = (struct http_message *) source;
-  struct mgos_telegram_request *request = (struct mgos_telegram_request *) dest;
+static void mgos_telegram_rate_timer_arm(double wait) {
+  // Single one-shot timer for the earliest held request
+  double at = mgos_uptime() + wait;
+  if (tg->rate_timer != MGOS_INVALID_TIMER_ID) {
+    if (tg->rate_timer_at <= at) return;
+    mgos_clear_timer(tg->rate_timer);
+  }
+  tg->rate_timer_at = at;
+  tg->rate_timer = mgos_set_timer((int) (wait * 1000) + 1, 0, mgos_telegram_rate_timer_cb, NULL);
+}
 
-  request->response->method = request->method;
-  json_scanf(hm->body.p, hm->body.len, "{ok: %B}", &request->response->ok);
-
-  if (request->response->ok) {
-    switch (request->method) {
-      case SEND_MESSAGE:
-      case EDIT_MESSAGE_TEXT:
-      case CUSTOM_METHOD: {
-        json_scanf(hm->body.p, hm->body.len, "{result: {message_id: %u} }", &request->response->message_id);
-        json_scanf(hm->body.p, hm->body.len, "{result: {chat: {id: %lld}}}", &request->response->chat_id);
-        break;
-      }
-      default: {
-        break;
-      }
+static void mgos_telegram_rate_retry(struct mgos_telegram_request *request, struct http_message *hm) {
+  // Flood control reply, the request stays in the queue and is sent again after retry_after
+  mgos_telegram_parse_response(hm, request);
+  int retry_after = request->response->retry_after > 0 ? request->response->retry_after : 1;
+  LOG(LL_WARN, ("%s ->> Too many requests, retry %s after %d sec", LIB_NAME, mgos_telegram_request_method_name(request), retry_after));
+  tg->stats.throttle_429++;
+  request->not_before = mgos_uptime() + retry_after;
+  if (request->response->description != NULL) free(request->response->description);
+  memset(request->response, 0, sizeof(*request->response));
+}
+
+
+// TELEGRAM RETRY FN
+// Failed request is sent again after exponential backoff with jitter, up to telegram.retry_max
+// times. Only telegram.escalate_after failures in a row close everything and test the token again
+static double mgos_telegram_retry_backoff(int attempt) {
+  double base = tg->cfg->retry_base_ms > 0 ? tg->cfg->retry_base_ms : 500;
+  double max = tg->cfg->retry_max_ms > base ? tg->cfg->retry_max_ms : base;
+  double delay = base;
+  while (--attempt > 0 && delay < max) delay *= 2;
+  if (delay > max) delay = max;
+  // Random half of the delay spreads retries of many requests and devices
+  delay = delay / 2 + (delay / 2) * rand() / RAND_MAX;
+  return delay / 1000;
+}
+
+static bool mgos_telegram_retry_escalate(void) {
+  tg->fail_streak++;
+  if (tg->cfg->escalate_after <= 0 || tg->fail_streak < tg->cfg->escalate_after) return false;
+  LOG(LL_WARN, ("%s ->> %d failures in a row, reconnecting", LIB_NAME, tg->fail_streak));
+  tg->fail_streak = 0;
+  tg->stats.escalations++;
+  mgos_telegram_close_all_connections();
+  mgos_telegram_check_token();
+  return true;
+}
+
+static void mgos_telegram_request_complete(struct mgos_telegram_request *request, struct http_message *hm) {
+  // Request without reply completes with ok: false after retries are exhausted
+  if (request->callback != NULL || !SLIST_EMPTY(&request->merged_cbs)) {
+    struct mgos_telegram_request_cb *cb;
+    if (hm != NULL) mgos_telegram_parse_response(hm, request);
+    else {
+      request->response->method = request->method;
+      request->response->ok = false;
+      if (request->response->description == NULL) request->response->description = strdup("No reply from server");
     }
+    if (request->callback != NULL) request->callback(request->response, request->userdata);
+    SLIST_FOREACH(cb, &request->merged_cbs, next) cb->callback(request->response, cb->userdata);
   }
-  else {
-    json_scanf(hm->body.p, hm->body.len, "{error_code: %d, description: %Q}", 
-      &request->response->error_code, &request->response->description);    
+  if (hm != NULL) tg->stats.requests_sent++;
+  mgos_telegram_request_queue_remove(request);
+  mgos_telegram_request_free(request);
+}
+
+static void mgos_telegram_request_failed(struct mgos_telegram_request *request) {
+  // Token test stays queued and is sent again by the backoff timer of mgos_telegram_check_token(),
+  // the request pump is stopped until the token is tested
+  if (request->method == GET_ME) {
+    request->conn = NULL;
+    mgos_telegram_check_token();
+    return;
+  }
+  // Error recorded before sending (e.g. missing upload file) is final, it is not a connection failure
+  if (request->response->description != NULL) {
+    mgos_telegram_request_complete(request, NULL);
+    return;
   }
+  if (mgos_telegram_retry_escalate()) return;
+  if (++request->retries > tg->cfg->retry_max) {
+    LOG(LL_WARN, ("%s ->> %s failed after %d retries", LIB_NAME, mgos_telegram_request_method_name(request), tg->cfg->retry_max));
+    tg->stats.retries_exhausted++;
+    mgos_telegram_request_complete(request, NULL);
+    return;
+  }
+  double delay = mgos_telegram_retry_backoff(request->retries);
+  LOG(LL_INFO, ("%s ->> Retry %d of %s in %d ms", LIB_NAME, request->retries, mgos_telegram_request_method_name(request), (int) (delay * 1000)));
+  tg->stats.retries++;
+  request->not_before = mgos_uptime() + delay;
 }
 
+static void mgos_telegram_poll_retry_cb(void *arg) {
+  tg->poll_timer = MGOS_INVALID_TIMER_ID;
+  if (tg->auth_token_tested && mgos_telegram_http_poll_wanted()) mgos_telegram_http_poll_once();
+  (void) arg;
+}
 
-// TELEGRAM HTTP FN
-static void mgos_telegram_http_poll_once() {
-  if (tg->poll_connected) return;
+static void mgos_telegram_poll_failed(void) {
+  bool conflict = tg->poll_conflict;
+  tg->poll_conflict = false;
+  if (!conflict && mgos_telegram_retry_escalate()) return;
+  double delay = mgos_telegram_retry_backoff(++tg->poll_retries);
+  LOG(LL_INFO, ("%s ->> Retry getUpdates in %d ms", LIB_NAME, (int) (delay * 1000)));
+  tg->stats.retries++;
+  if (tg->poll_timer == MGOS_INVALID_TIMER_ID) {
+    tg->poll_timer = mgos_set_timer((int) (delay * 1000), 0, mgos_telegram_poll_retry_cb, NULL);
+  }
+}
+
+
+// TELEGRAM SERVICE FN
+// Access list is parsed once into sorted array and searched with binary search
+static int mgos_telegram_acl_cmp(const void *a, const void *b) {
+  int64_t x = *(const int64_t *) a;
+  int64_t y = *(const int64_t *) b;
+  return (x > y) - (x < y);
+}
+
+static int mgos_telegram_acl_find(int64_t user_id, bool *found) {
+  int lo = 0, hi = tg->acl_len;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (tg->acl[mid] < user_id) lo = mid + 1;
+    else hi = mid;
+  }
+  *found = (lo < tg->acl_len && tg->acl[lo] == user_id);
+  return lo;
+}
+
+static void mgos_telegram_acl_append(struct mgos_telegram *tg, int64_t user_id) {
+  if (tg->acl_len == tg->acl_size) {
+    tg->acl_size = tg->acl_size > 0 ? tg->acl_size * 2 : 8;
+    tg->acl = (int64_t *) realloc(tg->acl, tg->acl_size * sizeof(*tg->acl));
+  }
+  tg->acl[tg->acl_len++] = user_id;
+}
+
+static void mgos_telegram_acl_walk_cb(void *data, const char *name, size_t name_len, const char *path, const struct json_token *t) {
+  if (t->type != JSON_TYPE_NUMBER) return;
+  int64_t user_id = mgos_telegram_json_to_int(t);
+  if (user_id == 0) return;
+  mgos_telegram_acl_append((struct mgos_telegram *) data, user_id);
+  (void) name;
+  (void) name_len;
+  (void) path;
+}
 
+static void mgos_telegram_acl_build(struct mgos_telegram *tg) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  tg->poll_connected = true;
-  
-  char *url = NULL;
-  char *eh = NULL;
-  char *pd = NULL;
+  tg->acl_len = 0;
+  // Copy of the source is kept, config setter may put a new string at the same address
+  free(tg->acl_src);
+  tg->acl_src = strdup(tg->cfg->acl != NULL ? tg->cfg->acl : "");
+  json_walk(tg->acl_src, strlen(tg->acl_src), mgos_telegram_acl_walk_cb, tg);
+  for (int i = 0; i < tg->acl_runtime_len; i++) mgos_telegram_acl_append(tg, tg->acl_runtime[i]);
+  if (tg->acl_len == 0) return;
+
+  // Sort and drop duplicates
+  qsort(tg->acl, tg->acl_len, sizeof(*tg->acl), mgos_telegram_acl_cmp);
+  int len = 1;
+  for (int i = 1; i < tg->acl_len; i++) {
+    if (tg->acl[i] != tg->acl[len - 1]) tg->acl[len++] = tg->acl[i];
+  }
+  tg->acl_len = len;
+  LOG(LL_INFO, ("%s ->> Access list loaded, %d user(s)", LIB_NAME, tg->acl_len));
+}
 
-  mg_asprintf(&url, 0, "%s/bot%s/getUpdates", tg->cfg->server, tg->cfg->token);
-  mg_asprintf(&eh, 0, "Content-Type: application/json\r\n");
-  pd = json_asprintf("{limit: 1, timeout: %d, offset: %d, allowed_updates: [%Q, %Q]}",
-    tg->cfg->timeout > 0 ? tg->cfg->timeout : 60,
-    tg->update_id > 0 ? tg->update_id + 1 : 0,
-    "message", "callback_query");
+static bool mgos_telegram_acl_insert(int64_t user_id) {
+  bool found;
+  int pos = mgos_telegram_acl_find(user_id, &found);
+  if (found) return false;
+  mgos_telegram_acl_append(tg, user_id);
+  memmove(&tg->acl[pos + 1], &tg->acl[pos], (tg->acl_len - 1 - pos) * sizeof(*tg->acl));
+  tg->acl[pos] = user_id;
+  return true;
+}
 
-  tg->nc_poll = mg_connect_http(mgos_get_mgr(), mgos_telegram_http_update_handler, NULL, url, eh, pd);
+static void mgos_telegram_acl_sync(void) {
+  // Change of telegram.acl is picked up once per getUpdates request or webhook call, not per update
+  const char *acl = tg->cfg->acl != NULL ? tg->cfg->acl : "";
+  if (tg->acl_src == NULL || strcmp(acl, tg->acl_src) != 0) mgos_telegram_acl_build(tg);
+}
+
+static bool mgos_telegram_check_user_access(uint64_t user_id) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  bool allowed = false;
+
+  if (tg->acl_len == 0) {
+    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Access list is empty, ignore update"));
+    return allowed;
+  }
+
+  mgos_telegram_acl_find((int64_t) user_id, &allowed);
+
+  if (allowed) LOG(LL_DEBUG, ("%s ->> Access allowed for user_id: %llu, accept update", LIB_NAME, user_id));
+  else LOG(LL_INFO, ("%s ->> Access denied for user_id: %llu, ignore update", LIB_NAME, user_id));
+
+  return allowed;
+}
+
+// Subscriptions are routed by command token through a case-insensitive hash table,
+// "prefix*" routes are checked longest first and "*" is the fallback route
+static uint32_t mgos_telegram_route_hash(const char *key, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t) tolower((unsigned char) key[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static size_t mgos_telegram_route_key(const char *data, const char **args) {
+  // Command token ends at first whitespace, "/cmd@BotName" is routed as "/cmd"
+  size_t len = strcspn(data, " \t\r\n");
+  const char *tail = data + len;
+  while (*tail == ' ' || *tail == '\t' || *tail == '\r' || *tail == '\n') tail++;
+  if (args != NULL) *args = tail;
+  if (data[0] == '/') {
+    const char *at = memchr(data, '@', len);
+    if (at != NULL) len = at - data;
+  }
+  return len;
+}
+
+struct mgos_telegram_subscription *mgos_telegram_subscription_search(const char *data, const char **args) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (tg->subscriptions_num == 0 || data == NULL) return NULL;
+
+  struct mgos_telegram_subscription *subscription;
+  size_t len = mgos_telegram_route_key(data, args);
+  uint32_t hash = mgos_telegram_route_hash(data, len);
+
+  SLIST_FOREACH(subscription, &tg->routes[hash % ROUTES_NUM], next) {
+    if (subscription->hash == hash && subscription->len == len && strncasecmp(subscription->data, data, len) == 0) {
+      return subscription;
+    }
+  }
+  SLIST_FOREACH(subscription, &tg->prefix_routes, next) {
+    if (strncasecmp(subscription->data, data, subscription->len) == 0) {
+      if (args != NULL) *args = data + subscription->len;
+      return subscription;
+    }
+  }
+  if (args != NULL && tg->wildcard_route != NULL) *args = data;
+
+  return tg->wildcard_route;
+}
+
+static struct mgos_telegram_subscription *mgos_telegram_subscription_find(const char *data) {
+  struct mgos_telegram_subscription *subscription;
+  size_t len = strlen(data);
+
+  if (strcmp(data, "*") == 0) return tg->wildcard_route;
+  if (len > 0 && data[len - 1] == '*') {
+    SLIST_FOREACH(subscription, &tg->prefix_routes, next) {
+      if (subscription->len == len - 1 && strncasecmp(subscription->data, data, len - 1) == 0) return subscription;
+    }
+    return NULL;
+  }
+  uint32_t hash = mgos_telegram_route_hash(data, len);
+  SLIST_FOREACH(subscription, &tg->routes[hash % ROUTES_NUM], next) {
+    if (subscription->len == len && strcasecmp(subscription->data, data) == 0) return subscription;
+  }
+  return NULL;
+}
+
+
+// Response parser walks the JSON once with json_walk() and picks fields by their path,
+// update parser lives in mgos_telegram_parse.c
+static void mgos_telegram_response_walk_cb(void *data, const char *name, size_t name_len, const char *path, const struct json_token *t) {
+  struct mgos_telegram_response *response = (struct mgos_telegram_response *) data;
+
+  switch (t->type) {
+    case JSON_TYPE_TRUE:
+    case JSON_TYPE_FALSE: {
+      if (strcmp(path, ".ok") == 0) response->ok = (t->type == JSON_TYPE_TRUE);
+      break;
+    }
+    case JSON_TYPE_NUMBER: {
+      if (strcmp(path, ".result.message_id") == 0) response->message_id = (int) mgos_telegram_json_to_int(t);
+      else if (strcmp(path, ".result.chat.id") == 0) response->chat_id = mgos_telegram_json_to_int(t);
+      else if (strcmp(path, ".error_code") == 0) response->error_code = (int) mgos_telegram_json_to_int(t);
+      else if (strcmp(path, ".parameters.retry_after") == 0) response->retry_after = (int) mgos_telegram_json_to_int(t);
+      break;
+    }
+    case JSON_TYPE_STRING: {
+      if (strcmp(path, ".description") == 0) mgos_telegram_json_to_str(t, &response->description, NULL, 0);
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+
+  (void) name;
+  (void) name_len;
+}
+
+static void mgos_telegram_parse_response(void *source, void *dest) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+
+  struct http_message *hm = (struct http_message *) source;
+  struct mgos_telegram_request *request = (struct mgos_telegram_request *) dest;
+
+  request->response->method = request->method;
+  json_walk(hm->body.p, hm->body.len, mgos_telegram_response_walk_cb, request->response);
+}
+
+
+// TELEGRAM TEMPLATE FN
+// Template skeleton is split at registration into literal JSON parts and typed
+// placeholders, sending a template only prints the arguments between the literals
+static bool mgos_telegram_template_is_chat_id(const char *lit, size_t len) {
+  static const char key[] = "chat_id";
+  size_t klen = sizeof(key) - 1;
+  while (len > 0 && isspace((unsigned char) lit[len - 1])) len--;
+  if (len == 0 || lit[--len] != ':') return false;
+  while (len > 0 && isspace((unsigned char) lit[len - 1])) len--;
+  if (len > 0 && lit[len - 1] == '"') len--;
+  if (len < klen || strncmp(lit + len - klen, key, klen) != 0) return false;
+  return len == klen || !(isalnum((unsigned char) lit[len - klen - 1]) || lit[len - klen - 1] == '_');
+}
+
+static bool mgos_telegram_template_compile(struct mgos_telegram_template *tpl, const char *skeleton) {
+  size_t size = strlen(skeleton);
+  size_t pos = 0, start = 0;
+  int n = 0;
+
+  tpl->literals = (char *) malloc(size + 1);
+  tpl->parts = (struct mgos_telegram_template_part *) calloc(TEMPLATE_ARGS_MAX + 1, sizeof(*tpl->parts));
+  tpl->chat_id_arg = -1;
+  for (const char *p = skeleton; *p != '\0'; p++) {
+    if (*p != '%') {
+      tpl->literals[pos++] = *p;
+      continue;
+    }
+    if (p[1] == '%') {
+      tpl->literals[pos++] = '%';
+      p++;
+      continue;
+    }
+    if (p[1] == '\0' || strchr("IDFQB", p[1]) == NULL) {
+      LOG(LL_ERROR, ("%s ->> Unknown template placeholder at: %s", LIB_NAME, p));
+      return false;
+    }
+    if (n == TEMPLATE_ARGS_MAX) {
+      LOG(LL_ERROR, ("%s ->> Template has more than %d placeholders", LIB_NAME, TEMPLATE_ARGS_MAX));
+      return false;
+    }
+    if (tpl->chat_id_arg < 0 && (p[1] == 'I' || p[1] == 'D') &&
+        mgos_telegram_template_is_chat_id(tpl->literals, pos)) {
+      tpl->chat_id_arg = n;
+    }
+    tpl->parts[n].offset = start;
+    tpl->parts[n].len = pos - start;
+    tpl->parts[n].type = p[1];
+    n++;
+    start = pos;
+    p++;
+  }
+  tpl->literals[pos] = '\0';
+  tpl->parts[n].offset = start;
+  tpl->parts[n].len = pos - start;
+  tpl->parts[n].type = 0;
+  tpl->parts_num = n + 1;
+  return true;
+}
+
+static int mgos_telegram_template_print(struct json_out *out, const struct mgos_telegram_template *tpl, const struct mgos_telegram_template_arg *args) {
+  int len = 0;
+  for (int i = 0; i < tpl->parts_num; i++) {
+    const struct mgos_telegram_template_part *part = &tpl->parts[i];
+    const struct mgos_telegram_template_arg *arg = &args[i];
+    len += out->printer(out, tpl->literals + part->offset, part->len);
+    if (part->type == 0) break;
+    // Arguments taken from JSON are already escaped, they are copied as is
+    if (arg->raw != NULL) {
+      if (part->type == 'Q') len += out->printer(out, "\"", 1);
+      len += out->printer(out, arg->raw, arg->raw_len);
+      if (part->type == 'Q') len += out->printer(out, "\"", 1);
+      continue;
+    }
+    switch (part->type) {
+      case 'I':
+      case 'D': len += json_printf(out, "%lld", (long long) arg->num); break;
+      case 'F': len += json_printf(out, "%.10g", arg->dbl); break;
+      case 'Q': len += json_printf(out, "%Q", arg->str); break;
+      case 'B': len += json_printf(out, "%B", (int) arg->num); break;
+    }
+  }
+  return len;
+}
+
+static char *mgos_telegram_template_asprintf(const struct mgos_telegram_template *tpl, const struct mgos_telegram_template_arg *args, char *buf, size_t size) {
+  char dummy[1];
+  struct json_out out = JSON_OUT_BUF(buf != NULL ? buf : dummy, buf != NULL ? size : sizeof(dummy));
+  int len = mgos_telegram_template_print(&out, tpl, args);
+  if (buf != NULL && (size_t) len < size) return buf;
+  if (buf != NULL) tg->stats.prealloc_misses++;
+
+  char *json = (char *) malloc(len + 1);
+  struct json_out out2 = JSON_OUT_BUF(json, len + 1);
+  mgos_telegram_template_print(&out2, tpl, args);
+  return json;
+}
+
+static void mgos_telegram_template_args_va(const struct mgos_telegram_template *tpl, struct mgos_telegram_template_arg *args, va_list ap) {
+  for (int i = 0; i < tpl->parts_num - 1; i++) {
+    struct mgos_telegram_template_arg *arg = &args[i];
+    memset(arg, 0, sizeof(*arg));
+    switch (tpl->parts[i].type) {
+      case 'I': arg->num = va_arg(ap, int64_t); break;
+      case 'D': arg->num = va_arg(ap, int); break;
+      case 'F': arg->dbl = va_arg(ap, double); break;
+      case 'Q': arg->str = va_arg(ap, const char *); break;
+      case 'B': arg->num = va_arg(ap, int) ? 1 : 0; break;
+    }
+  }
+}
+
+struct mgos_telegram_template_parser {
+  const struct mgos_telegram_template *tpl;
+  struct mgos_telegram_template_arg *args;
+  int count;
+  bool error;
+};
+
+static void mgos_telegram_template_args_walk_cb(void *data, const char *name, size_t name_len, const char *path, const struct json_token *t) {
+  struct mgos_telegram_template_parser *parser = (struct mgos_telegram_template_parser *) data;
+  // Only scalar items of the top level array are arguments
+  if (path[0] != '[' || strchr(path + 1, '[') != NULL || strchr(path, '.') != NULL) return;
+  if (t->type == JSON_TYPE_OBJECT_START || t->type == JSON_TYPE_ARRAY_START) {
+    parser->error = true;
+    return;
+  }
+  if (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END) return;
+  int i = atoi(path + 1);
+  if (i != parser->count || i >= parser->tpl->parts_num - 1) {
+    parser->error = true;
+    return;
+  }
+
+  char type = parser->tpl->parts[i].type;
+  struct mgos_telegram_template_arg *arg = &parser->args[i];
+  bool ok = false;
+  switch (type) {
+    case 'I':
+    case 'D':
+    case 'F': ok = (t->type == JSON_TYPE_NUMBER); break;
+    case 'Q': ok = (t->type == JSON_TYPE_STRING); break;
+    case 'B': ok = (t->type == JSON_TYPE_TRUE || t->type == JSON_TYPE_FALSE); break;
+  }
+  if (!ok) {
+    LOG(LL_ERROR, ("%s ->> Template argument %d has wrong type, %%%c expected", LIB_NAME, i, type));
+    parser->error = true;
+    return;
+  }
+  memset(arg, 0, sizeof(*arg));
+  arg->raw = t->ptr;
+  arg->raw_len = t->len;
+  if (type == 'I' || type == 'D') arg->num = mgos_telegram_json_to_int(t);
+  parser->count++;
+
+  (void) name;
+  (void) name_len;
+}
+
+static bool mgos_telegram_template_send(int id, const struct mgos_telegram_template_arg *args, mgos_telegram_cb_t callback, void *userdata) {
+  const struct mgos_telegram_template *tpl = &tg->templates[id];
+  struct mgos_telegram_request *request = mgos_telegram_request_alloc();
+  request->method = tpl->method;
+  if (tpl->method == CUSTOM_METHOD) mgos_telegram_request_set_method(request, tpl->custom_method);
+  if (tpl->chat_id_arg >= 0) request->chat_id = args[tpl->chat_id_arg].num;
+  request->callback = callback;
+  request->userdata = userdata;
+  request->json = mgos_telegram_template_asprintf(tpl, args, request->body_buf, tg->body_size);
+
+  LOG(LL_DEBUG, ("%s: %s %s", LIB_NAME, "Send template ->>", request->json));
+  bool is_added = mgos_telegram_request_queue_add(request);
+  if (!is_added) {
+    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Error while sending template"));
+    mgos_telegram_request_free(request);
+  }
+  return is_added;
+}
+
+static bool mgos_telegram_template_check_id(int id) {
+  if (!mgos_telegram_can_queue()) {
+    LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Telegram bot is not active, unable execute method"));
+    return false;
+  }
+  if (id < 0 || id >= tg->templates_num) {
+    LOG(LL_ERROR, ("%s ->> Unknown template id: %d", LIB_NAME, id));
+    return false;
+  }
+  return true;
+}
+
+
+// TELEGRAM POLL STREAM FN
+static void mgos_telegram_poll_stream_reset(void) {
+  struct mgos_telegram_poll_stream *st = &tg->poll_stream;
+  struct mbuf buf = st->buf;
+  // With telegram.prealloc the buffer keeps its capacity between polls, otherwise it is released
+  if (tg->update_slab == NULL) {
+    mbuf_free(&buf);
+    mbuf_init(&buf, 0);
+  }
+  else mbuf_remove(&buf, buf.len);
+  memset(st, 0, sizeof(*st));
+  st->buf = buf;
+  st->state = STREAM_HEADERS;
+  st->body_left = -1;
+}
+
+static void mgos_telegram_poll_stream_update(const char *json, size_t len) {
+  struct update_queue updates = STAILQ_HEAD_INITIALIZER(updates);
+  struct mgos_telegram_update *update;
+
+  mgos_telegram_parse_updates(json, len, false, &updates);
+
+  // Update which does not fit the queue is held, not dropped: the offset moves past it
+  // anyway, so it is never downloaded again
+  while ((update = STAILQ_FIRST(&updates)) != NULL) {
+    STAILQ_REMOVE_HEAD(&updates, next);
+    mgos_telegram_offset_set(update->update_id);
+    if ( mgos_telegram_is_update_queue_overflow() ) {
+      STAILQ_INSERT_TAIL(&tg->update_pending, update, next);
+      tg->stats.refetches_avoided++;
+    }
+    else mgos_telegram_update_queue_insert(update);
+    tg->poll_stream.count++;
+  }
+}
+
+static void mgos_telegram_poll_stream_append(const char *p, size_t n) {
+  struct mbuf *buf = &tg->poll_stream.buf;
+  size_t size = buf->size;
+  mbuf_append(buf, p, n);
+  if (tg->update_slab != NULL && buf->size != size) tg->stats.prealloc_misses++;
+}
+
+static void mgos_telegram_poll_stream_scan(const char *p, size_t n) {
+  // Splits {"ok":true,"result":[{...},{...}]} into update objects, only the
+  // update being received is kept in memory, so reply size does not matter
+  struct mgos_telegram_poll_stream *st = &tg->poll_stream;
+  size_t start = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    char c = p[i];
+    if (st->in_str) {
+      if (st->esc) st->esc = false;
+      else if (c == '\\') st->esc = true;
+      else if (c == '"') st->in_str = false;
+      continue;
+    }
+    if (c == '"') {
+      st->in_str = true;
+    }
+    else if (c == '{' || c == '[') {
+      if (st->depth == 1 && c == '[') st->in_result = true;
+      else if (st->depth == 2 && st->in_result && c == '{') {
+        st->in_update = true;
+        start = i;
+      }
+      st->depth++;
+    }
+    else if (c == '}' || c == ']') {
+      st->depth--;
+      if (st->depth == 1) st->in_result = false;
+      else if (st->depth == 2 && st->in_update) {
+        st->in_update = false;
+        mgos_telegram_poll_stream_append(p + start, i + 1 - start);
+        if ((int) st->buf.len > tg->stats.poll_buffer_peak) tg->stats.poll_buffer_peak = st->buf.len;
+        mgos_telegram_poll_stream_update(st->buf.buf, st->buf.len);
+        mbuf_remove(&st->buf, st->buf.len);
+      }
+    }
+  }
+  // Update continues in the next piece
+  if (st->in_update) mgos_telegram_poll_stream_append(p + start, n - start);
+}
+
+static bool mgos_telegram_poll_stream_headers(struct mg_connection *nc) {
+  struct mgos_telegram_poll_stream *st = &tg->poll_stream;
+  struct mbuf *io = &nc->recv_mbuf;
+  struct http_message hm;
+
+  int len = mg_parse_http(io->buf, io->len, &hm, 0);
+  if (len == 0) return false;
+  if (len < 0) {
+    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Poll HTTP connection got malformed reply"));
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return false;
+  }
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Poll HTTP connection got data"));
+  st->state = STREAM_DONE;
+  if (hm.resp_code >= 400) mgos_telegram_metrics_error(hm.resp_code);
+
+  if (hm.resp_code == 401) {
+    tg->poll_replied = true;
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    mgos_telegram_token_rejected();
+    return false;
+  }
+  // Other error replies leave poll_replied unset, polling restarts after backoff like on connection failure
+  if (hm.resp_code != 200) {
+    // Webhook left from webhook mode blocks getUpdates, delete it, the conflict is not a server failure
+    if (hm.resp_code == 409) {
+      LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "getUpdates conflicts with active webhook, deleting it"));
+      tg->poll_conflict = true;
+      mgos_telegram_webhook_request("deleteWebhook");
+    }
+    else LOG(LL_WARN, ("%s ->> getUpdates failed with HTTP %d", LIB_NAME, hm.resp_code));
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return false;
+  }
+  tg->poll_replied = true;
+  tg->poll_retries = 0;
+  tg->fail_streak = 0;
+  struct mg_str *te = mg_get_http_header(&hm, "Transfer-Encoding");
+  struct mg_str *cl = mg_get_http_header(&hm, "Content-Length");
+  if (te != NULL && mg_vcasecmp(te, "chunked") == 0) {
+    st->state = STREAM_CHUNK_SIZE;
+  }
+  else {
+    // Header value is followed by CRLF, strtol stops there
+    st->body_left = cl != NULL ? strtol(cl->p, NULL, 10) : -1;
+    st->state = st->body_left == 0 ? STREAM_DONE : STREAM_BODY;
+  }
+  mbuf_remove(io, len);
+  return true;
+}
+
+static void mgos_telegram_poll_stream_body(struct mbuf *io) {
+  struct mgos_telegram_poll_stream *st = &tg->poll_stream;
+
+  // Everything received is consumed, incomplete chunk size line waits for more
+  while (io->len > 0 && st->state != STREAM_DONE) {
+    switch (st->state) {
+      case STREAM_BODY: {
+        size_t n = io->len;
+        if (st->body_left >= 0 && (int64_t) n > st->body_left) n = st->body_left;
+        mgos_telegram_poll_stream_scan(io->buf, n);
+        mbuf_remove(io, n);
+        if (st->body_left >= 0) {
+          st->body_left -= n;
+          if (st->body_left == 0) st->state = STREAM_DONE;
+        }
+        break;
+      }
+      case STREAM_CHUNK_SIZE:
+      case STREAM_CHUNK_END: {
+        const char *eol = (const char *) memchr(io->buf, '\n', io->len);
+        if (eol == NULL) return;
+        if (st->state == STREAM_CHUNK_SIZE) {
+          st->chunk_left = strtoul(io->buf, NULL, 16);
+          st->state = st->chunk_left == 0 ? STREAM_DONE : STREAM_CHUNK_DATA;
+        }
+        else {
+          st->state = STREAM_CHUNK_SIZE;
+        }
+        mbuf_remove(io, eol - io->buf + 1);
+        break;
+      }
+      case STREAM_CHUNK_DATA: {
+        size_t n = io->len < st->chunk_left ? io->len : st->chunk_left;
+        mgos_telegram_poll_stream_scan(io->buf, n);
+        mbuf_remove(io, n);
+        st->chunk_left -= n;
+        if (st->chunk_left == 0) st->state = STREAM_CHUNK_END;
+        break;
+      }
+      default: {
+        return;
+      }
+    }
+  }
+}
+
+static void mgos_telegram_poll_stream_done(struct mg_connection *nc) {
+  struct mgos_telegram_poll_stream *st = &tg->poll_stream;
+  bool replied = st->state != STREAM_HEADERS;
+
+  st->state = STREAM_DONE;
+  mbuf_free(&st->buf);
+  mbuf_init(&st->buf, 0);
+  mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  if (!replied) return;
+
+  if (st->count == 0) LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Poll HTTP connection empty data"));
+  else LOG(LL_DEBUG, ("%s ->> Poll HTTP connection got %d update(s)", LIB_NAME, st->count));
+  if (st->count > 0) mgos_telegram_update_queue_kick();
+}
+
+
+// TELEGRAM HTTP FN
+// Long polling runs while someone consumes updates, in webhook mode updates are pushed
+static bool mgos_telegram_http_poll_wanted(void) {
+  return !tg->cfg->webhook && (tg->subscriptions_num > 0 || tg->cfg->echo_bot);
+}
+
+static void mgos_telegram_http_poll_once() {
+  if (tg->poll_connected || tg->cfg->webhook) return;
+
+  // Nothing is fetched while it can't be queued, dispatch resumes polling when a slot is free
+  if (mgos_telegram_update_queue_free_slots() == 0 || !STAILQ_EMPTY(&tg->update_pending)) {
+    if (!tg->poll_suspended) {
+      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Update queue is full, polling suspended"));
+      tg->poll_suspended = true;
+      tg->poll_suspended_at = mgos_uptime();
+    }
+    return;
+  }
+
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  mgos_telegram_acl_sync();
+  tg->poll_connected = true;
+  tg->poll_replied = false;
+  tg->poll_conflict = false;
+  tg->poll_started_at = mgos_uptime();
+  if (tg->poll_timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(tg->poll_timer);
+    tg->poll_timer = MGOS_INVALID_TIMER_ID;
+  }
+
+  char pd[128];
+  struct json_out out = JSON_OUT_BUF(pd, sizeof(pd));
+
+  // Ask for as many updates as the queue can absorb, but at least one and
+  // no more than telegram.poll_batch (Bot API caps the limit at 100)
+  int limit = mgos_telegram_update_queue_free_slots();
+  if (tg->cfg->poll_batch > 0 && limit > tg->cfg->poll_batch) limit = tg->cfg->poll_batch;
+  if (limit > 100) limit = 100;
+  if (limit < 1) limit = 1;
+
+  json_printf(&out, "{limit: %d, timeout: %d, offset: %u, allowed_updates: [%Q, %Q]}",
+    limit,
+    tg->cfg->timeout > 0 ? tg->cfg->timeout : 60,
+    tg->update_id > 0 ? tg->update_id + 1 : 0,
+    "message", "callback_query");
+
+  // Poll reply is parsed straight from the socket buffer, see TELEGRAM POLL STREAM FN
+  mgos_telegram_poll_stream_reset();
+  tg->nc_poll = mgos_telegram_http_connect(mgos_telegram_http_update_handler, NULL, false);
+  if (tg->nc_poll == NULL) {
+    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Update HTTP connection error"));
+    tg->poll_connected = false;
+    return;
+  }
+  mgos_telegram_http_write_request(tg->nc_poll, "getUpdates", pd);
+}
+
+static void mgos_telegram_http_poll_resume(void) {
+  if (mgos_telegram_update_queue_free_slots() == 0 || !STAILQ_EMPTY(&tg->update_pending)) return;
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Update queue has free slots, polling resumed"));
+  tg->poll_suspended = false;
+  tg->stats.poll_suspended_ms += (uint32_t) ((mgos_uptime() - tg->poll_suspended_at) * 1000);
+  if (mgos_telegram_http_poll_wanted()) mgos_telegram_http_poll_once();
+}
+
+static void mgos_telegram_http_update_handler(struct mg_connection *nc, int ev, void *ev_data, void *userdata) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+
+  switch (ev) {
+    case MG_EV_CONNECT: {
+      int connect_status = *(int *) ev_data;
+      // Failure is handled on close, which follows the connect error
+      if (connect_status != 0) {
+        LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Update HTTP connection error"));
+        break;
+      }
+      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Poll HTTP connection opened"));
+      break;
+    }
+    case MG_EV_SEND: {
+      mgos_telegram_metrics_io(ev, ev_data);
+      break;
+    }
+    case MG_EV_RECV: {
+      mgos_telegram_metrics_io(ev, ev_data);
+      // Bytes of a dropped poll or left after the reply are of no use
+      if (nc != tg->nc_poll || tg->poll_stream.state == STREAM_DONE) {
+        mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+        break;
+      }
+      if (tg->poll_stream.state == STREAM_HEADERS && !mgos_telegram_poll_stream_headers(nc)) break;
+      mgos_telegram_poll_stream_body(&nc->recv_mbuf);
+      if (tg->poll_stream.state == STREAM_DONE) mgos_telegram_poll_stream_done(nc);
+      break;
+    }
+    case MG_EV_CLOSE: {
+      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Poll HTTP connection closed"));
+      // Connection dropped by mgos_telegram_close_all_connections() is not ours anymore
+      if (nc != tg->nc_poll) break;
+      // Body without Content-Length ends with the connection
+      if (tg->poll_stream.state != STREAM_DONE) mgos_telegram_poll_stream_done(nc);
+      if (tg->poll_replied) mgos_telegram_metrics_hist(&tg->metrics.poll_cycle, mgos_uptime() - tg->poll_started_at);
+      tg->poll_connected = false;
+      tg->nc_poll = NULL;
+      if (!tg->poll_replied) mgos_telegram_poll_failed();
+      else if (mgos_telegram_http_poll_wanted()) {
+        mgos_telegram_http_poll_once();
+      }
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+
+  (void) ev_data;
+  (void) userdata;
+}
+
+static const char *mgos_telegram_request_method_name(const struct mgos_telegram_request *request) {
+  switch (request->method) {
+    case GET_ME:                return "getMe";
+    case SEND_MESSAGE:          return "sendMessage";
+    case EDIT_MESSAGE_TEXT:     return "editMessageText";
+    case ANSWER_CALLBACK_QUERY: return "answerCallbackQuery";
+    case CUSTOM_METHOD:         return request->custom_method;
+    default:                    return NULL;
+  }
+}
+
+static struct mg_connection *mgos_telegram_http_connect(mg_event_handler_t handler, void *userdata, bool http) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  struct mg_connect_opts opts;
+  memset(&opts, 0, sizeof(opts));
+#if MG_ENABLE_SSL
+  // Same TLS defaults as mg_connect_http() uses for https:// urls
+  if (tg->server_ssl) {
+    opts.ssl_ca_cert = "*";
+    opts.ssl_server_name = tg->server_host;
+  }
+#endif
+  struct mg_connection *nc = mg_connect_opt(mgos_get_mgr(), tg->server_addr, handler, userdata, opts);
+  if (nc != NULL && http) mg_set_protocol_http_websocket(nc);
+  return nc;
+}
+
+static void mgos_telegram_http_write_request(struct mg_connection *nc, const char *method, const char *body) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  // Request is assembled straight in the send buffer from the prefix computed at init,
+  // the body is copied only once, from the request to the socket buffer
+  char hdr[80];
+  int hdr_len;
+  size_t len = body != NULL ? strlen(body) : 0;
+
+  if (body != NULL) mg_send(nc, "POST ", 5);
+  else mg_send(nc, "GET ", 4);
+  mg_send(nc, tg->http_prefix, strlen(tg->http_prefix));
+  mg_send(nc, method, strlen(method));
+  mg_send(nc, tg->http_host, strlen(tg->http_host));
+  if (body == NULL) {
+    mg_send(nc, "\r\n", 2);
+    return;
+  }
+  hdr_len = snprintf(hdr, sizeof(hdr), "Content-Type: application/json\r\nContent-Length: %d\r\n\r\n", (int) len);
+  mg_send(nc, hdr, hdr_len);
+  mg_send(nc, body, len);
+}
+
+static void mgos_telegram_http_send_request(struct mgos_telegram_conn *conn, struct mgos_telegram_request *request) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+
+  const char *method = mgos_telegram_request_method_name(request);
+  if (method == NULL) return;
+
+  // Reuse the idle keep-alive connection if there is one, otherwise open a new one
+  if (conn->nc == NULL) {
+    conn->nc = mgos_telegram_http_connect(mgos_telegram_http_request_handler, conn, true);
+    if (conn->nc == NULL) {
+      LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Request HTTP connection error"));
+      if (request->method == GET_ME) {
+        mgos_telegram_request_failed(request);
+        return;
+      }
+      // Request is still iterated by the pump, so it only gets a delay here
+      double delay = mgos_telegram_retry_backoff(++request->retries);
+      request->not_before = mgos_uptime() + delay;
+      mgos_telegram_rate_timer_arm(delay);
+      return;
+    }
+    tg->stats.pool_connects++;
+    conn->connect_at = mgos_uptime();
+  }
+  else {
+    LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Request HTTP connection reused"));
+    mg_set_timer(conn->nc, 0);
+    tg->stats.pool_reuses++;
+  }
+
+  conn->request = request;
+  request->conn = conn;
+  // Wait is measured once, retries only restart the round trip
+  if (request->queued_at > 0) {
+    mgos_telegram_metrics_hist(&tg->metrics.request_wait, mgos_uptime() - request->queued_at);
+    request->queued_at = 0;
+  }
+  request->sent_at = mgos_uptime();
+  request->first_byte = false;
+  tg->stats.pool_dispatched++;
+  mgos_telegram_conn_update_stats();
+  if (request->file != NULL) mgos_telegram_upload_write(conn->nc, method, request);
+  else mgos_telegram_http_write_request(conn->nc, method, request->method == GET_ME ? NULL : request->json);
+}
+
+static void mgos_telegram_http_request_handler(struct mg_connection *nc, int ev, void *ev_data, void *userdata) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  struct mgos_telegram_conn *conn = (struct mgos_telegram_conn *) userdata;
+
+  switch (ev) {
+    case MG_EV_CONNECT: {
+      int connect_status = *(int *) ev_data;
+      // Failure is handled on close, which follows the connect error
+      if (connect_status != 0) {
+        LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Request HTTP connection error"));
+        break;
+      }
+      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Request HTTP connection opened"));
+      // With TLS mongoose reports connect after the handshake, so it is included
+      if (nc == conn->nc && conn->request != NULL) {
+        mgos_telegram_metrics_hist(&tg->metrics.methods[conn->request->method].connect, mgos_uptime() - conn->connect_at);
+      }
+      break;
+    }
+    case MG_EV_RECV: {
+      mgos_telegram_metrics_io(ev, ev_data);
+      if (nc == conn->nc && conn->request != NULL && !conn->request->first_byte) {
+        conn->request->first_byte = true;
+        mgos_telegram_metrics_hist(&tg->metrics.methods[conn->request->method].first_byte, mgos_uptime() - conn->request->sent_at);
+      }
+      break;
+    }
+    case MG_EV_HTTP_REPLY: {
+      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Request HTTP connection got data"));
+      struct http_message *hm = (struct http_message *) ev_data;
+      struct mgos_telegram_request *request = conn->request;
+      if (nc != conn->nc || request == NULL) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        break;
+      }
+      enum mgos_telegram_request_method request_method = request->method;
+      mgos_telegram_metrics_hist(&tg->metrics.methods[request_method].total, mgos_uptime() - request->sent_at);
+      if (hm->resp_code >= 400) mgos_telegram_metrics_error(hm->resp_code);
+      // Server may reply before the whole file is sent, the rest can't be skipped on this connection
+      bool upload_cut = mgos_telegram_upload_close(request);
+      conn->request = NULL;
+      request->conn = NULL;
+      tg->fail_streak = 0;
+      mgos_telegram_conn_update_stats();
+      if (hm->resp_code == 429) mgos_telegram_rate_retry(request, hm);
+      else mgos_telegram_request_complete(request, hm);
+      if (hm->resp_code == 401 && request_method != GET_ME) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        mgos_telegram_token_rejected();
+        break;
+      }
+      mgos_telegram_request_queue_kick();
+      // Keep connection open for the next request unless keep-alive is off or server refused it
+      struct mg_str *conn_hdr = mg_get_http_header(hm, "Connection");
+      if (tg->cfg->keep_alive <= 0 || upload_cut || (conn_hdr != NULL && mg_vcasecmp(conn_hdr, "close") == 0)) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      }
+      else {
+        mg_set_timer(nc, mg_time() + tg->cfg->keep_alive);
+      }
+      break;
+    }
+    case MG_EV_SEND: {
+      mgos_telegram_metrics_io(ev, ev_data);
+      // File is read as the socket drains, so only a chunk of it is buffered at a time
+      if (nc == conn->nc && conn->request != NULL && conn->request->upload != NULL) {
+        mgos_telegram_upload_pump(nc, conn->request);
+      }
+      break;
+    }
+    case MG_EV_TIMER: {
+      // Idle timeout expired
+      if (nc == conn->nc && conn->request == NULL) {
+        LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Request HTTP connection idle timeout"));
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      }
+      break;
+    }
+    case MG_EV_CLOSE: {
+      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Request HTTP connection closed"));
+      // Request that didn't get a reply stays in the queue and will be sent again after backoff
+      if (nc == conn->nc) {
+        struct mgos_telegram_request *request = conn->request;
+        conn->nc = NULL;
+        conn->request = NULL;
+        mgos_telegram_conn_update_stats();
+        if (request != NULL) {
+          request->conn = NULL;
+          mgos_telegram_upload_close(request);
+          mgos_telegram_request_failed(request);
+        }
+        mgos_telegram_request_queue_kick();
+      }
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+
+  (void) ev_data;
+  (void) userdata;
+}
+
+
+// TELEGRAM UPLOAD FN
+// File body is streamed from the filesystem: parts before the file are kept in request->json,
+// the file is opened when the request is sent and read in UPLOAD_CHUNK_SIZE pieces on MG_EV_SEND
+static const char upload_epilogue[] = "\r\n--" UPLOAD_BOUNDARY "--\r\n";
+
+static void mgos_telegram_upload_write(struct mg_connection *nc, const char *method, struct mgos_telegram_request *request) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  char hdr[128];
+  int hdr_len;
+  struct stat st;
+
+  // File is opened on every attempt. File removed after the request was queued can't be sent
+  // by any retry, so the request fails with the recorded description when the connection closes
+  mgos_telegram_upload_close(request);
+  if (stat(request->file, &st) != 0 || (request->upload = fopen(request->file, "rb")) == NULL) {
+    LOG(LL_WARN, ("%s ->> Unable to open file %s", LIB_NAME, request->file));
+    if (request->response->description == NULL) request->response->description = strdup("Unable to open file");
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  request->upload_left = st.st_size;
+
+  size_t len = strlen(request->json) + request->upload_left + sizeof(upload_epilogue) - 1;
+  mg_send(nc, "POST ", 5);
+  mg_send(nc, tg->http_prefix, strlen(tg->http_prefix));
+  mg_send(nc, method, strlen(method));
+  mg_send(nc, tg->http_host, strlen(tg->http_host));
+  hdr_len = snprintf(hdr, sizeof(hdr), "Content-Type: multipart/form-data; boundary=%s\r\nContent-Length: %d\r\n\r\n", UPLOAD_BOUNDARY, (int) len);
+  mg_send(nc, hdr, hdr_len);
+  mg_send(nc, request->json, strlen(request->json));
+  mgos_telegram_upload_pump(nc, request);
+}
+
+static void mgos_telegram_upload_pump(struct mg_connection *nc, struct mgos_telegram_request *request) {
+  char buf[UPLOAD_CHUNK_SIZE];
+
+  while (request->upload_left > 0 && nc->send_mbuf.len < UPLOAD_CHUNK_SIZE) {
+    size_t n = request->upload_left < sizeof(buf) ? request->upload_left : sizeof(buf);
+    size_t got = fread(buf, 1, n, request->upload);
+    if (got == 0) {
+      // File was truncated while sending, Content-Length can't be met anymore
+      LOG(LL_WARN, ("%s ->> Unable to read file %s", LIB_NAME, request->file));
+      mgos_telegram_upload_close(request);
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      return;
+    }
+    mg_send(nc, buf, got);
+    request->upload_left -= got;
+    tg->stats.upload_bytes += got;
+  }
+  if (request->upload_left == 0) {
+    mg_send(nc, upload_epilogue, sizeof(upload_epilogue) - 1);
+    mgos_telegram_upload_close(request);
+  }
+}
+
+static bool mgos_telegram_upload_close(struct mgos_telegram_request *request) {
+  // Returns true if the file was not sent completely
+  if (request->upload == NULL) return false;
+  fclose(request->upload);
+  request->upload = NULL;
+  return request->upload_left > 0;
+}
+
+
+// TELEGRAM OFFSET FN
+// Last accepted update_id is kept in telegram.offset_file, so the first poll after boot
+// gets only new updates. Writes are deferred by telegram.offset_flush_ms and batched
+static void mgos_telegram_offset_set(uint32_t update_id) {
+  tg->update_id = update_id;
+  if (tg->cfg->offset_file == NULL || tg->cfg->offset_file[0] == '\0') return;
+  if (tg->offset_timer != MGOS_INVALID_TIMER_ID || tg->update_id == tg->offset_saved) return;
+  int delay = tg->cfg->offset_flush_ms > 0 ? tg->cfg->offset_flush_ms : 0;
+  tg->offset_timer = mgos_set_timer(delay, 0, mgos_telegram_offset_flush_cb, NULL);
+}
+
+static void mgos_telegram_offset_flush(void) {
+  if (tg->cfg->offset_file == NULL || tg->cfg->offset_file[0] == '\0') return;
+  if (tg->update_id == tg->offset_saved) return;
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (json_fprintf(tg->cfg->offset_file, "{update_id: %u}", tg->update_id) <= 0) {
+    LOG(LL_WARN, ("%s ->> Unable to save update offset to %s", LIB_NAME, tg->cfg->offset_file));
+    return;
+  }
+  tg->offset_saved = tg->update_id;
+  tg->stats.offset_writes++;
+}
+
+static void mgos_telegram_offset_flush_cb(void *arg) {
+  tg->offset_timer = MGOS_INVALID_TIMER_ID;
+  mgos_telegram_offset_flush();
+  (void) arg;
+}
+
+static void mgos_telegram_offset_reboot_cb(int ev, void *ev_data, void *userdata) {
+  // Offset waiting for the timer is saved before restart
+  if (tg->offset_timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(tg->offset_timer);
+    tg->offset_timer = MGOS_INVALID_TIMER_ID;
+  }
+  mgos_telegram_offset_flush();
+  (void) ev;
+  (void) ev_data;
+  (void) userdata;
+}
+
+static void mgos_telegram_offset_restore(struct mgos_telegram *tg) {
+  tg->offset_timer = MGOS_INVALID_TIMER_ID;
+  if (tg->cfg->offset_file == NULL || tg->cfg->offset_file[0] == '\0') return;
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, mgos_telegram_offset_reboot_cb, NULL);
+  // Missing or damaged file means offset 0, as without persistence
+  char *data = json_fread(tg->cfg->offset_file);
+  if (data == NULL) return;
+  unsigned int update_id = 0;
+  if (json_scanf(data, strlen(data), "{update_id: %u}", &update_id) == 1) {
+    tg->update_id = tg->offset_saved = update_id;
+    LOG(LL_INFO, ("%s ->> Restored update offset %u", LIB_NAME, update_id));
+  }
+  free(data);
+}
+
+
+// TELEGRAM SPOOL FN
+// Requests which don't fit the queue or are made offline are kept in telegram.spool_file,
+// a ring of telegram.spool_size bytes where the oldest records are evicted first.
+// The spool is drained into the queue as soon as there are free slots and the bot is active.
+// Header is kept in RAM and written by a timer, so a burst of pushes and drains costs one
+// header write. Callbacks are kept in RAM by record sequence number, they don't survive reboot
+static bool mgos_telegram_spool_accepts(const struct mgos_telegram_request *request) {
+  // Callback query answers are useless when late. Edits stay in RAM, where a newer edit
+  // of the message supersedes the queued one
+  if (tg->cfg->spool_file == NULL || tg->cfg->spool_file[0] == '\0') return false;
+  if (!SLIST_EMPTY(&request->merged_cbs)) return false;
+  if (request->json == NULL || request->file != NULL) return false;
+  return request->method == SEND_MESSAGE || request->method == CUSTOM_METHOD;
+}
+
+static uint32_t mgos_telegram_spool_area(void) {
+  int size = tg->cfg->spool_size - (int) sizeof(struct mgos_telegram_spool_hdr);
+  return size > 0 ? (uint32_t) size : 0;
+}
+
+static void mgos_telegram_spool_cb_notify(void) {
+  // Lost records are reported after the spool is closed, callbacks may send new requests
+  struct mgos_telegram_spool_cb *cb;
+  while ((cb = STAILQ_FIRST(&tg->spool_cbs_lost)) != NULL) {
+    STAILQ_REMOVE_HEAD(&tg->spool_cbs_lost, next);
+    struct mgos_telegram_response *response = mgos_telegram_response_alloc();
+    response->method = cb->method;
+    response->ok = false;
+    response->description = strdup("Request was dropped from spool");
+    cb->callback(response, cb->userdata);
+    mgos_telegram_response_free(response);
+    free(cb);
+  }
+}
+
+static void mgos_telegram_spool_cb_take(uint32_t seq, struct mgos_telegram_request *request) {
+  // Callback of the record leaving the spool goes to its request, or gets ok: false if the
+  // record is evicted. Records before it are gone already
+  struct mgos_telegram_spool_cb *cb;
+  while ((cb = STAILQ_FIRST(&tg->spool_cbs)) != NULL && (int32_t) (cb->seq - seq) <= 0) {
+    STAILQ_REMOVE_HEAD(&tg->spool_cbs, next);
+    if (cb->seq == seq && request != NULL) {
+      request->callback = cb->callback;
+      request->userdata = cb->userdata;
+      free(cb);
+    }
+    else STAILQ_INSERT_TAIL(&tg->spool_cbs_lost, cb, next);
+  }
+}
+
+static void mgos_telegram_spool_reset(void) {
+  STAILQ_CONCAT(&tg->spool_cbs_lost, &tg->spool_cbs);
+  memset(&tg->spool_hdr, 0, sizeof(tg->spool_hdr));
+  tg->spool_hdr.magic = SPOOL_MAGIC;
+  tg->spool_count = tg->stats.spool_depth = 0;
+}
+
+static bool mgos_telegram_spool_write_hdr(FILE *fp) {
+  if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&tg->spool_hdr, sizeof(tg->spool_hdr), 1, fp) != 1) {
+    LOG(LL_WARN, ("%s ->> Unable to write spool %s", LIB_NAME, tg->cfg->spool_file));
+    return false;
+  }
+  tg->spool_saved_used = tg->spool_hdr.used;
+  tg->spool_unsaved = 0;
+  tg->spool_dirty = false;
+  tg->stats.spool_hdr_writes++;
+  return true;
+}
+
+static FILE *mgos_telegram_spool_open(void) {
+  // Missing, damaged or resized spool starts empty
+  FILE *fp = tg->spool_hdr.magic == SPOOL_MAGIC ? fopen(tg->cfg->spool_file, "r+b") : NULL;
+  if (fp != NULL) return fp;
+  mgos_telegram_spool_reset();
+  fp = fopen(tg->cfg->spool_file, "w+b");
+  if (fp == NULL || !mgos_telegram_spool_write_hdr(fp)) {
+    LOG(LL_WARN, ("%s ->> Unable to open spool %s", LIB_NAME, tg->cfg->spool_file));
+    if (fp != NULL) fclose(fp);
+    tg->spool_hdr.magic = 0;
+    return NULL;
+  }
+  return fp;
+}
+
+static bool mgos_telegram_spool_io(FILE *fp, uint32_t pos, void *buf, size_t len, bool write) {
+  // Record may wrap around the end of the ring. Tail never runs ahead of the end
+  // of file, so writes only append to it or overwrite the ring
+  uint32_t area = mgos_telegram_spool_area();
+  char *p = (char *) buf;
+  while (len > 0) {
+    size_t n = area - pos < len ? area - pos : len;
+    if (fseek(fp, sizeof(struct mgos_telegram_spool_hdr) + pos, SEEK_SET) != 0) return false;
+    if ((write ? fwrite(p, 1, n, fp) : fread(p, 1, n, fp)) != n) return false;
+    p += n;
+    len -= n;
+    pos = (pos + n) % area;
+  }
+  return true;
+}
 
-  if (url !=NULL) free(url);
-  if (eh !=NULL) free(eh);
-  if (pd !=NULL) free(pd);
+static void mgos_telegram_spool_close(FILE *fp, bool changed) {
+  fclose(fp);
+  tg->spool_count = tg->stats.spool_depth = tg->spool_hdr.count;
+  if (changed) {
+    tg->spool_dirty = true;
+    if (tg->spool_timer == MGOS_INVALID_TIMER_ID) {
+      int delay = tg->cfg->spool_flush_ms > 0 ? tg->cfg->spool_flush_ms : 0;
+      tg->spool_timer = mgos_set_timer(delay, 0, mgos_telegram_spool_flush_cb, NULL);
+    }
+  }
+  mgos_telegram_spool_cb_notify();
 }
 
-static void mgos_telegram_http_update_handler(struct mg_connection *nc, int ev, void *ev_data, void *userdata) {
+static void mgos_telegram_spool_flush(void) {
+  // Records pushed after the last header write are lost on power loss, drained ones are sent again
+  if (!tg->spool_dirty) return;
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  FILE *fp = fopen(tg->cfg->spool_file, "r+b");
+  if (fp == NULL) {
+    LOG(LL_WARN, ("%s ->> Unable to open spool %s", LIB_NAME, tg->cfg->spool_file));
+    return;
+  }
+  mgos_telegram_spool_write_hdr(fp);
+  fclose(fp);
+}
 
-  switch (ev) {
-    case MG_EV_CONNECT: {
-      int connect_status = *(int *) ev_data;
-      if (connect_status != 0) {
-        LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Update HTTP connection error"));
-        mgos_telegram_close_all_connections();
-        mgos_telegram_check_token();
-        break;
-      }
-      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Poll HTTP connection opened"));
-      break;
-    }
-    case MG_EV_HTTP_REPLY: {
-      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Poll HTTP connection got data"));
-      
-      // IF RX QUEUE OVERFLOW WILL TRY NEXT TIME      
-      if ( mgos_telegram_is_update_queue_overflow() ) {
-        nc->flags |= MG_F_CLOSE_IMMEDIATELY;        
-        break;
-      }
-      
-      struct http_message *hm = (struct http_message *) ev_data;
-      struct mgos_telegram_update *update = mgos_telegram_update_alloc();
+static void mgos_telegram_spool_flush_cb(void *arg) {
+  tg->spool_timer = MGOS_INVALID_TIMER_ID;
+  mgos_telegram_spool_flush();
+  (void) arg;
+}
 
-      uint32_t update_id = 0;
-      mgos_telegram_parse_update(hm, update, &update_id);
-      if (update_id > 0) {
-        tg->update_id = update_id;
-        STAILQ_INSERT_TAIL(&tg->update_queue, update, next);  
-      }
-      else {
-        LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Poll HTTP connection empty data"));
-        mgos_telegram_update_free(update);
-      }
-      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-      break;
-    }
-    case MG_EV_CLOSE: {
-      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Poll HTTP connection closed"));
-      tg->poll_connected = false;
-      tg->nc_poll = NULL;
-      if ( !SLIST_EMPTY(&tg->subscriptions) ) {
-        mgos_telegram_http_poll_once();
-      }
-      break;
-    }
-    default: {
-      break;
-    }
+static void mgos_telegram_spool_reboot_cb(int ev, void *ev_data, void *userdata) {
+  // Header waiting for the timer is saved before restart
+  if (tg->spool_timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(tg->spool_timer);
+    tg->spool_timer = MGOS_INVALID_TIMER_ID;
   }
-
+  mgos_telegram_spool_flush();
+  (void) ev;
   (void) ev_data;
   (void) userdata;
 }
 
-static void mgos_telegram_http_send_request(struct mgos_telegram_request *request) {
+static bool mgos_telegram_spool_push(const struct mgos_telegram_request *request) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  tg->out_connected = true;
-  char *url = NULL;
-  char *eh = NULL;
-  char *pd = NULL;
+  uint32_t area = mgos_telegram_spool_area();
+  const char *method = request->method == CUSTOM_METHOD ? request->custom_method : "";
+  size_t method_len = strlen(method), json_len = strlen(request->json);
+  size_t len = 3 + method_len + json_len;
+  if (method_len > 255 || len > 0xffff || len + 2 > area) return false;
+
+  FILE *fp = mgos_telegram_spool_open();
+  if (fp == NULL) {
+    mgos_telegram_spool_cb_notify();
+    return false;
+  }
+  struct mgos_telegram_spool_hdr *hdr = &tg->spool_hdr;
+
+  // Make room by evicting the oldest records
+  while (hdr->count > 0 && hdr->used + len + 2 > area) {
+    uint16_t old_len;
+    if (!mgos_telegram_spool_io(fp, hdr->head, &old_len, sizeof(old_len), false)) break;
+    hdr->head = (hdr->head + old_len + 2) % area;
+    hdr->used -= old_len + 2;
+    hdr->count--;
+    mgos_telegram_spool_cb_take(tg->spool_seq++, NULL);
+    tg->stats.spool_evicted++;
+  }
 
-  mg_asprintf(&eh, 0, "Content-Type: application/json\r\n");
-  
-  switch (request->method) {
-    case GET_ME: {
-      mg_asprintf(&url, 0, "%s/bot%s/%s", tg->cfg->server, tg->cfg->token, "getMe");
-      break;
-    }
-    case SEND_MESSAGE: {
-      mg_asprintf(&url, 0, "%s/bot%s/%s", tg->cfg->server, tg->cfg->token, "sendMessage");
-      mg_asprintf(&pd, 0, request->json);
-      break;
+  // Record must not overwrite bytes which the header on flash still counts as used
+  bool ok = hdr->used + len + 2 <= area;
+  if (ok && tg->spool_unsaved + len + 2 > area - tg->spool_saved_used) ok = mgos_telegram_spool_write_hdr(fp);
+
+  uint16_t rec_len = len;
+  uint8_t rec_hdr[3] = {(uint8_t) request->method, (uint8_t) request->priority, (uint8_t) method_len};
+  uint32_t pos = hdr->tail;
+  ok = ok && mgos_telegram_spool_io(fp, pos, &rec_len, sizeof(rec_len), true);
+  pos = (pos + sizeof(rec_len)) % area;
+  ok = ok && mgos_telegram_spool_io(fp, pos, rec_hdr, sizeof(rec_hdr), true);
+  pos = (pos + sizeof(rec_hdr)) % area;
+  ok = ok && mgos_telegram_spool_io(fp, pos, (void *) method, method_len, true);
+  pos = (pos + method_len) % area;
+  ok = ok && mgos_telegram_spool_io(fp, pos, request->json, json_len, true);
+  if (ok) {
+    hdr->tail = (pos + json_len) % area;
+    hdr->used += len + 2;
+    tg->spool_unsaved += len + 2;
+    if (request->callback != NULL) {
+      if (tg->request_slab != NULL) tg->stats.prealloc_misses++;
+      struct mgos_telegram_spool_cb *cb = (struct mgos_telegram_spool_cb *) calloc(1, sizeof(*cb));
+      cb->seq = tg->spool_seq + hdr->count;
+      cb->method = request->method;
+      cb->callback = request->callback;
+      cb->userdata = request->userdata;
+      STAILQ_INSERT_TAIL(&tg->spool_cbs, cb, next);
     }
-    case EDIT_MESSAGE_TEXT: {
-      mg_asprintf(&url, 0, "%s/bot%s/%s", tg->cfg->server, tg->cfg->token, "editMessageText");
-      mg_asprintf(&pd, 0, request->json);
+    hdr->count++;
+    tg->stats.spooled++;
+  }
+  else LOG(LL_WARN, ("%s ->> Unable to write spool %s", LIB_NAME, tg->cfg->spool_file));
+  mgos_telegram_spool_close(fp, true);
+  return ok;
+}
+
+static void mgos_telegram_spool_drain(void) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  uint32_t area = mgos_telegram_spool_area();
+  FILE *fp = mgos_telegram_spool_open();
+  if (fp == NULL) {
+    tg->spool_count = 0;
+    mgos_telegram_spool_cb_notify();
+    return;
+  }
+  struct mgos_telegram_spool_hdr *hdr = &tg->spool_hdr;
+  bool changed = false;
+
+  // Move records in order while their priority class has free slots
+  while (hdr->count > 0) {
+    uint16_t len;
+    uint8_t rec_hdr[3];
+    if (!mgos_telegram_spool_io(fp, hdr->head, &len, sizeof(len), false) || len < sizeof(rec_hdr) ||
+        !mgos_telegram_spool_io(fp, (hdr->head + sizeof(len)) % area, rec_hdr, sizeof(rec_hdr), false)) {
+      LOG(LL_WARN, ("%s ->> Spool %s is damaged, dropping it", LIB_NAME, tg->cfg->spool_file));
+      mgos_telegram_spool_reset();
+      mgos_telegram_spool_write_hdr(fp);
       break;
     }
-    case ANSWER_CALLBACK_QUERY: {
-      mg_asprintf(&url, 0, "%s/bot%s/%s", tg->cfg->server, tg->cfg->token, "answerCallbackQuery");
-      mg_asprintf(&pd, 0, request->json);
+    struct mgos_telegram_request *request = mgos_telegram_request_alloc();
+    request->method = (enum mgos_telegram_request_method) rec_hdr[0];
+    request->priority = (enum mgos_telegram_priority) (int8_t) rec_hdr[1];
+    if (mgos_telegram_is_request_queue_overflow(mgos_telegram_request_priority(request))) {
+      mgos_telegram_request_free(request);
       break;
     }
-    case CUSTOM_METHOD: {
-      mg_asprintf(&url, 0, "%s/bot%s/%s", tg->cfg->server, tg->cfg->token, request->custom_method);
-      mg_asprintf(&pd, 0, request->json);
-      break;
+
+    char *rec = (char *) malloc(len + 1);
+    bool ok = mgos_telegram_spool_io(fp, (hdr->head + sizeof(len)) % area, rec, len, false);
+    rec[len] = '\0';
+    if (ok && request->method == CUSTOM_METHOD) {
+      char method[256];
+      memcpy(method, rec + 3, rec_hdr[2]);
+      method[rec_hdr[2]] = '\0';
+      mgos_telegram_request_set_method(request, method);
     }
-    default: {
+    if (ok) mgos_telegram_request_set_json(request, rec + 3 + rec_hdr[2]);
+    free(rec);
+    hdr->head = (hdr->head + len + 2) % area;
+    hdr->used -= len + 2;
+    hdr->count--;
+    changed = true;
+    mgos_telegram_spool_cb_take(tg->spool_seq++, request);
+    if (ok && mgos_telegram_request_queue_push(request)) tg->stats.spool_drained++;
+    else mgos_telegram_request_free(request);
+  }
+  mgos_telegram_spool_close(fp, changed);
+}
+
+static void mgos_telegram_spool_init(struct mgos_telegram *tg) {
+  STAILQ_INIT(&tg->spool_cbs);
+  STAILQ_INIT(&tg->spool_cbs_lost);
+  tg->spool_timer = MGOS_INVALID_TIMER_ID;
+  if (tg->cfg->spool_file == NULL || tg->cfg->spool_file[0] == '\0') return;
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, mgos_telegram_spool_reboot_cb, NULL);
+  // Only the header is read here, damaged spool is reset by the first push or drain
+  struct mgos_telegram_spool_hdr hdr;
+  int area = tg->cfg->spool_size - (int) sizeof(hdr);
+  FILE *fp = fopen(tg->cfg->spool_file, "rb");
+  if (fp == NULL) return;
+  bool ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 && hdr.magic == SPOOL_MAGIC && area > 0 &&
+    hdr.used <= (uint32_t) area && hdr.head < (uint32_t) area && hdr.tail < (uint32_t) area;
+  fclose(fp);
+  if (!ok) return;
+  tg->spool_hdr = hdr;
+  tg->spool_saved_used = hdr.used;
+  tg->spool_count = tg->stats.spool_depth = hdr.count;
+  if (hdr.count > 0) LOG(LL_INFO, ("%s ->> %d request(s) waiting in spool", LIB_NAME, (int) hdr.count));
+}
+
+
+// TELEGRAM METRICS FN
+// Timings are kept in log2 histograms of milliseconds, memory doesn't grow with traffic
+static const char *metrics_method_names[] = {NULL, "getMe", "sendMessage", "editMessageText", "answerCallbackQuery", "custom"};
+
+static void mgos_telegram_metrics_hist(struct mgos_telegram_histogram *hist, double seconds) {
+  uint32_t ms = seconds > 0 ? (uint32_t) (seconds * 1000) : 0;
+  int i = 0;
+  while (i < MGOS_TELEGRAM_HIST_BUCKETS - 1 && ms >= (1u << i)) i++;
+  hist->buckets[i]++;
+  hist->count++;
+  hist->sum_ms += ms;
+  if (ms > hist->max_ms) hist->max_ms = ms;
+}
+
+static void mgos_telegram_metrics_error(int code) {
+  struct mgos_telegram_error_count *e = tg->metrics.errors;
+  for (int i = 0; i < MGOS_TELEGRAM_ERROR_SLOTS; i++) {
+    if (e[i].code == 0) e[i].code = code;
+    if (e[i].code == code) {
+      e[i].count++;
       return;
     }
   }
+  tg->metrics.errors_other++;
+}
 
-  tg->nc_out = mg_connect_http(mgos_get_mgr(), mgos_telegram_http_request_handler, request, url, eh, pd);
+static void mgos_telegram_metrics_io(int ev, void *ev_data) {
+  int num = *(int *) ev_data;
+  if (num <= 0) return;
+  if (ev == MG_EV_SEND) tg->metrics.bytes_sent += num;
+  else tg->metrics.bytes_received += num;
+}
 
-  if (url !=NULL) free(url);
-  if (eh !=NULL) free(eh);
-  if (pd !=NULL) free(pd);
+static int mgos_telegram_metrics_print_hist(struct json_out *out, va_list *ap) {
+  const struct mgos_telegram_histogram *hist = va_arg(*ap, const struct mgos_telegram_histogram *);
+  int len = json_printf(out, "{count: %u, sum_ms: %u, max_ms: %u, buckets: [", hist->count, hist->sum_ms, hist->max_ms);
+  for (int i = 0; i < MGOS_TELEGRAM_HIST_BUCKETS; i++) {
+    len += json_printf(out, i > 0 ? ", %u" : "%u", hist->buckets[i]);
+  }
+  return len + json_printf(out, "]}");
 }
 
-static void mgos_telegram_http_request_handler(struct mg_connection *nc, int ev, void *ev_data, void *userdata) {
+static int mgos_telegram_metrics_print(struct json_out *out, va_list *ap) {
+  const struct mgos_telegram_metrics *m = va_arg(*ap, const struct mgos_telegram_metrics *);
+  int len = json_printf(out, "{methods: {");
+  for (int i = GET_ME; i <= CUSTOM_METHOD; i++) {
+    const struct mgos_telegram_method_metrics *mm = &m->methods[i];
+    len += json_printf(out, "%s%Q: {connect: %M, first_byte: %M, total: %M}", i > GET_ME ? ", " : "", metrics_method_names[i],
+      mgos_telegram_metrics_print_hist, &mm->connect,
+      mgos_telegram_metrics_print_hist, &mm->first_byte,
+      mgos_telegram_metrics_print_hist, &mm->total);
+  }
+  len += json_printf(out, "}, request_wait: %M, update_wait: %M, poll_cycle: %M, bytes_sent: %u, bytes_received: %u, errors: {",
+    mgos_telegram_metrics_print_hist, &m->request_wait,
+    mgos_telegram_metrics_print_hist, &m->update_wait,
+    mgos_telegram_metrics_print_hist, &m->poll_cycle,
+    m->bytes_sent, m->bytes_received);
+  for (int i = 0; i < MGOS_TELEGRAM_ERROR_SLOTS && m->errors[i].code != 0; i++) {
+    len += json_printf(out, "%s\"%d\": %u", i > 0 ? ", " : "", m->errors[i].code, m->errors[i].count);
+  }
+  return len + json_printf(out, "}, errors_other: %u}", m->errors_other);
+}
+
+#ifdef MGOS_HAVE_RPC_COMMON
+static void mgos_telegram_rpc_stats_handler(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args) {
+  bool reset = false;
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  if (tg == NULL) {
+    mg_rpc_send_errorf(ri, 503, "%s", "Telegram bot is disabled");
+    return;
+  }
+  mg_rpc_send_responsef(ri, "%M", mgos_telegram_metrics_print, &tg->metrics);
+  if (reset) mgos_telegram_reset_metrics();
+  (void) cb_arg;
+  (void) fi;
+}
+#endif
+
+
+// TELEGRAM WEBHOOK FN
+// With telegram.webhook updates are pushed by the server to the embedded listener
+// (usually behind a reverse proxy which terminates TLS) instead of long polling
+static void mgos_telegram_webhook_cb(void *ev_data, void *userdata) {
+  struct mgos_telegram_response *response = (struct mgos_telegram_response *) ev_data;
+  const char *method = (const char *) userdata;
+  if (response->ok) {
+    LOG(LL_INFO, ("%s ->> %s %s", LIB_NAME, method, "successful"));
+    return;
+  }
+  LOG(LL_WARN, ("%s ->> %s failed: %s", LIB_NAME, method, response->description != NULL ? response->description : ""));
+  // Try to register the webhook again on the next activation
+  if (strcmp(method, "setWebhook") == 0) tg->webhook_set = false;
+}
+
+static void mgos_telegram_webhook_request(const char *method) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  struct mgos_telegram_request *request = mgos_telegram_request_alloc();
+  request->method = CUSTOM_METHOD;
+  request->priority = PRIORITY_CONTROL;
+  request->callback = mgos_telegram_webhook_cb;
+  request->userdata = (void *) method;
+  mgos_telegram_request_set_method(request, method);
+  if (strcmp(method, "setWebhook") != 0) {
+    mgos_telegram_request_set_json(request, "{}");
+  }
+  else if (tg->cfg->webhook_secret != NULL && tg->cfg->webhook_secret[0] != '\0') {
+    mgos_telegram_request_printf(request, "{url: %Q, secret_token: %Q, max_connections: %d, allowed_updates: [%Q, %Q]}",
+      tg->cfg->webhook_url, tg->cfg->webhook_secret, 1, "message", "callback_query");
+  }
+  else {
+    mgos_telegram_request_printf(request, "{url: %Q, max_connections: %d, allowed_updates: [%Q, %Q]}",
+      tg->cfg->webhook_url, 1, "message", "callback_query");
+  }
+  if (!mgos_telegram_request_queue_add(request)) mgos_telegram_request_free(request);
+}
 
-  switch (ev) {
-    case MG_EV_CONNECT: {
-      int connect_status = *(int *) ev_data;
-      if (connect_status != 0) {
-        LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Request HTTP connection error"));
-        mgos_telegram_close_all_connections();
-        mgos_telegram_check_token();
-        break;
-      }
-      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Request HTTP connection opened"));
-      break;
-    }
-    case MG_EV_HTTP_REPLY: {
-      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Request HTTP connection got data"));
-      struct http_message *hm = (struct http_message *) ev_data;
-      struct mgos_telegram_request *request = (struct mgos_telegram_request *) userdata;
-      if (request->callback != NULL) {
-        mgos_telegram_parse_response(hm, request);
-        request->callback(request->response, request->userdata);
-      }
-      STAILQ_REMOVE(&tg->request_queue, request, mgos_telegram_request, next);
-      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-      mgos_telegram_request_free(request);
-      break;
-    }
-    case MG_EV_CLOSE: {
-      LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, "Request HTTP connection closed"));
-      tg->out_connected = false;
-      tg->nc_out = NULL;
-      break;
-    }
-    default: {
-      break;
+static void mgos_telegram_webhook_handler(struct mg_connection *nc, int ev, void *ev_data, void *userdata) {
+  if (ev != MG_EV_HTTP_REQUEST) return;
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  struct http_message *hm = (struct http_message *) ev_data;
+
+  if (mg_vcmp(&hm->method, "POST") != 0) {
+    mg_http_send_error(nc, 405, NULL);
+    return;
+  }
+  // Secret token set by setWebhook proves the request comes from Telegram
+  if (tg->cfg->webhook_secret != NULL && tg->cfg->webhook_secret[0] != '\0') {
+    struct mg_str *secret = mg_get_http_header(hm, "X-Telegram-Bot-Api-Secret-Token");
+    if (secret == NULL || mg_vcmp(secret, tg->cfg->webhook_secret) != 0) {
+      LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Webhook request with wrong secret token"));
+      tg->stats.webhook_rejected++;
+      mg_http_send_error(nc, 403, NULL);
+      return;
     }
   }
+  // Server delivers the update again later if it is not accepted now
+  if (mgos_telegram_is_update_queue_overflow()) {
+    tg->stats.webhook_rejected++;
+    mg_http_send_error(nc, 503, NULL);
+    return;
+  }
 
-  (void) ev_data;
+  struct update_queue updates = STAILQ_HEAD_INITIALIZER(updates);
+  struct mgos_telegram_update *update;
+  mgos_telegram_acl_sync();
+  mgos_telegram_parse_updates(hm->body.p, hm->body.len, false, &updates);
+  while ((update = STAILQ_FIRST(&updates)) != NULL) {
+    STAILQ_REMOVE_HEAD(&updates, next);
+    // Redelivered update was already queued
+    if (update->update_id <= tg->update_id || mgos_telegram_is_update_queue_overflow()) {
+      if (update->update_id > tg->update_id) tg->stats.updates_dropped++;
+      mgos_telegram_update_free(update);
+      continue;
+    }
+    mgos_telegram_offset_set(update->update_id);
+    tg->stats.webhook_updates++;
+    mgos_telegram_update_queue_insert(update);
+  }
+  mgos_telegram_update_queue_kick();
+  mg_send_head(nc, 200, 0, NULL);
   (void) userdata;
 }
 
+static void mgos_telegram_webhook_listen(struct mgos_telegram *tg) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  const char *address = tg->cfg->webhook_listen != NULL && tg->cfg->webhook_listen[0] != '\0' ? tg->cfg->webhook_listen : "8443";
+  struct mg_connection *nc = mg_bind(mgos_get_mgr(), address, mgos_telegram_webhook_handler, NULL);
+  if (nc == NULL) {
+    LOG(LL_ERROR, ("%s ->> Unable to start webhook listener on %s", LIB_NAME, address));
+    return;
+  }
+  mg_set_protocol_http_websocket(nc);
+  LOG(LL_INFO, ("%s ->> Webhook listener started on %s", LIB_NAME, address));
+}
+
 
 // TELEGRAM PUBLIC FN
 void mgos_telegram_subscribe(const char *data, mgos_telegram_cb_t callback, void *userdata) {
@@ -629,39 +2772,126 @@ void mgos_telegram_subscribe(const char *data, mgos_telegram_cb_t callback, void
   }
 
   // Check if already subscribed
-  struct mgos_telegram_subscription *subscription = mgos_telegram_subscription_search(data);
+  struct mgos_telegram_subscription *subscription = mgos_telegram_subscription_find(data);
   if (subscription) {
-    LOG(LL_INFO, ("%s ->> %s %s", LIB_NAME, "Subscription already exist:", subscription->data));
+    LOG(LL_INFO, ("%s ->> %s %s", LIB_NAME, "Subscription already exist:", data));
 	  return;
   }
   // Subscribe the command
   struct mgos_telegram_subscription *new_subscription = calloc(1, sizeof(*new_subscription));
-  mg_asprintf(&new_subscription->data, 0, data);
+  new_subscription->data = strdup(data);
+  new_subscription->len = strlen(data);
   new_subscription->callback = callback;
   new_subscription->userdata = userdata;
-  SLIST_INSERT_HEAD(&tg->subscriptions, new_subscription, next);
+  if (strcmp(data, "*") == 0) {
+    tg->wildcard_route = new_subscription;
+  }
+  else if (new_subscription->len > 0 && new_subscription->data[new_subscription->len - 1] == '*') {
+    // Keep prefix routes sorted by length, so the longest prefix matches first
+    struct mgos_telegram_subscription *s, *prev = NULL;
+    new_subscription->len--;
+    SLIST_FOREACH(s, &tg->prefix_routes, next) {
+      if (s->len < new_subscription->len) break;
+      prev = s;
+    }
+    if (prev == NULL) SLIST_INSERT_HEAD(&tg->prefix_routes, new_subscription, next);
+    else SLIST_INSERT_AFTER(prev, new_subscription, next);
+  }
+  else {
+    new_subscription->hash = mgos_telegram_route_hash(data, new_subscription->len);
+    SLIST_INSERT_HEAD(&tg->routes[new_subscription->hash % ROUTES_NUM], new_subscription, next);
+  }
+  tg->subscriptions_num++;
   LOG(LL_INFO, ("%s ->> %s %s", LIB_NAME, "Subscription success:", new_subscription->data));
-  // If update queue timer not set yet (e.g. it is first subscription), set this timer
-  if (tg->update_queue_timer == MGOS_INVALID_TIMER_ID) {
+  // If polling not started yet (e.g. it is first subscription), start it
+  if (!tg->poll_connected) {
     LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Subscription added, start polling"));
-    tg->update_queue_timer = mgos_set_timer(500, MGOS_TIMER_REPEAT, mgos_telegram_update_queue_handler, NULL);
     mgos_telegram_http_poll_once();
   }
 }
 
 
+bool mgos_telegram_acl_add(int64_t user_id) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (!tg || user_id == 0) return false;
+  mgos_telegram_acl_sync();
+
+  if (!mgos_telegram_acl_insert(user_id)) return true;
+  if (tg->acl_runtime_len == tg->acl_runtime_size) {
+    tg->acl_runtime_size = tg->acl_runtime_size > 0 ? tg->acl_runtime_size * 2 : 4;
+    tg->acl_runtime = (int64_t *) realloc(tg->acl_runtime, tg->acl_runtime_size * sizeof(*tg->acl_runtime));
+  }
+  tg->acl_runtime[tg->acl_runtime_len++] = user_id;
+  LOG(LL_INFO, ("%s ->> Access allowed for user_id: %lld", LIB_NAME, user_id));
+  return true;
+}
+
+bool mgos_telegram_acl_remove(int64_t user_id) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (!tg) return false;
+  mgos_telegram_acl_sync();
+
+  for (int i = 0; i < tg->acl_runtime_len; i++) {
+    if (tg->acl_runtime[i] == user_id) tg->acl_runtime[i--] = tg->acl_runtime[--tg->acl_runtime_len];
+  }
+  bool found;
+  int pos = mgos_telegram_acl_find(user_id, &found);
+  if (!found) return false;
+  memmove(&tg->acl[pos], &tg->acl[pos + 1], (tg->acl_len - pos - 1) * sizeof(*tg->acl));
+  tg->acl_len--;
+  LOG(LL_INFO, ("%s ->> Access revoked for user_id: %lld", LIB_NAME, user_id));
+  return true;
+}
+
+void mgos_telegram_acl_reload(void) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (!tg) return;
+  // Explicit reload returns to telegram.acl as is
+  tg->acl_runtime_len = 0;
+  mgos_telegram_acl_build(tg);
+}
+
+const struct mgos_telegram_stats *mgos_telegram_get_stats(void) {
+  return tg != NULL ? &tg->stats : NULL;
+}
+
+const struct mgos_telegram_metrics *mgos_telegram_get_metrics(void) {
+  return tg != NULL ? &tg->metrics : NULL;
+}
+
+void mgos_telegram_reset_metrics(void) {
+  if (tg != NULL) memset(&tg->metrics, 0, sizeof(tg->metrics));
+}
+
+const char *mgos_telegram_get_metrics_json(void) {
+  // String lives until the next call
+  if (tg == NULL) return NULL;
+  free(tg->metrics_json);
+  tg->metrics_json = json_asprintf("%M", mgos_telegram_metrics_print, &tg->metrics);
+  return tg->metrics_json;
+}
+
+
 void mgos_telegram_send_message_with_callback(int64_t chat_id, const char *text, mgos_telegram_cb_t callback, void *userdata) {  
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  if (!tg || !tg->auth_token_tested) {
+  if (!mgos_telegram_can_queue()) {
     LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Telegram bot is not active, unable execute method"));
     return;
   }
+  if (tg->cfg->coalesce_ms > 0 && mgos_telegram_request_coalesce(chat_id, text, callback, userdata)) return;
 
   struct mgos_telegram_request *request = mgos_telegram_request_alloc();
   request->method = SEND_MESSAGE;
+  request->chat_id = chat_id;
   request->callback = callback;
   request->userdata = userdata;
-  request->json = json_asprintf("{chat_id: %lld, text: %Q}", chat_id, text);
+  mgos_telegram_request_printf(request, "{chat_id: %lld, text: %Q}", chat_id, text);
+  if (tg->cfg->coalesce_ms > 0) {
+    // Hold the message for the window, so next texts to the chat can join it
+    request->coalesce = true;
+    request->text_len = strlen(text);
+    request->not_before = mgos_uptime() + tg->cfg->coalesce_ms / 1000.0;
+  }
   
   LOG(LL_DEBUG, ("%s: %s %s", LIB_NAME, "Send message ->>", request->json));
   bool is_added = mgos_telegram_request_queue_add(request);
@@ -676,18 +2906,19 @@ void mgos_telegram_send_message(int64_t chat_id, const char *text) {
   mgos_telegram_send_message_with_callback(chat_id, text, NULL, NULL);
 }
 
-void mgos_telegram_send_message_json_with_callback(const char *json, mgos_telegram_cb_t callback, void *userdata){
+void mgos_telegram_send_message_json_with_priority(const char *json, enum mgos_telegram_priority priority, mgos_telegram_cb_t callback, void *userdata){
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  if (!tg || !tg->auth_token_tested) {
+  if (!mgos_telegram_can_queue()) {
     LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Telegram bot is not active, unable execute method"));
     return;
   }
 
   struct mgos_telegram_request *request = mgos_telegram_request_alloc();
   request->method = SEND_MESSAGE;
+  request->priority = priority;
   request->callback = callback;
   request->userdata = userdata;
-  mg_asprintf(&request->json, 0, json);
+  mgos_telegram_request_set_json(request, json);
   
   LOG(LL_DEBUG, ("%s: %s %s", LIB_NAME, "Send message ->>", request->json));
   bool is_added = mgos_telegram_request_queue_add(request);
@@ -697,6 +2928,11 @@ void mgos_telegram_send_message_json_with_callback(const char *json, mgos_telegr
   }
 }
 
+void mgos_telegram_send_message_json_with_callback(const char *json, mgos_telegram_cb_t callback, void *userdata){
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  mgos_telegram_send_message_json_with_priority(json, PRIORITY_DEFAULT, callback, userdata);
+}
+
 void mgos_telegram_send_message_json(const char *json){
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
   mgos_telegram_send_message_json_with_callback(json, NULL, NULL);
@@ -705,14 +2941,16 @@ void mgos_telegram_send_message_json(const char *json){
 
 void mgos_telegram_edit_message_text(int64_t chat_id, uint32_t message_id, const char *text) {  
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  if (!tg || !tg->auth_token_tested) {
+  if (!mgos_telegram_can_queue()) {
     LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Telegram bot is not active, unable execute method"));
     return;
   }
 
   struct mgos_telegram_request *request = mgos_telegram_request_alloc();
   request->method = EDIT_MESSAGE_TEXT;
-  request->json = json_asprintf("{chat_id: %lld, message_id: %u, text: %Q}", chat_id, message_id, text);
+  request->chat_id = chat_id;
+  request->message_id = message_id;
+  mgos_telegram_request_printf(request, "{chat_id: %lld, message_id: %u, text: %Q}", chat_id, message_id, text);
   
   LOG(LL_DEBUG, ("%s: %s %s", LIB_NAME, "Edit message text ->>", request->json));
   bool is_added = mgos_telegram_request_queue_add(request);
@@ -724,14 +2962,14 @@ void mgos_telegram_edit_message_text(int64_t chat_id, uint32_t message_id, const
 
 void mgos_telegram_edit_message_text_json(const char *json) {  
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  if (!tg || !tg->auth_token_tested) {
+  if (!mgos_telegram_can_queue()) {
     LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Telegram bot is not active, unable execute method"));
     return;
   }
 
   struct mgos_telegram_request *request = mgos_telegram_request_alloc();
   request->method = EDIT_MESSAGE_TEXT;
-  mg_asprintf(&request->json, 0, json);
+  mgos_telegram_request_set_json(request, json);
   
   LOG(LL_DEBUG, ("%s: %s %s", LIB_NAME, "Edit message text ->>", request->json));
   bool is_added = mgos_telegram_request_queue_add(request);
@@ -751,7 +2989,7 @@ void mgos_telegram_answer_callback_query(const char *id, const char *text, bool
 
   struct mgos_telegram_request *request = mgos_telegram_request_alloc();
   request->method = ANSWER_CALLBACK_QUERY;
-  request->json = json_asprintf("{callback_query_id: %Q, text: %Q, show_alert: %B}", id, text, alert);
+  mgos_telegram_request_printf(request, "{callback_query_id: %Q, text: %Q, show_alert: %B}", id, text, alert);
   
   LOG(LL_DEBUG, ("%s: %s %s", LIB_NAME, "Answer callback query ->>", request->json));
   bool is_added = mgos_telegram_request_queue_add(request);
@@ -770,7 +3008,7 @@ void mgos_telegram_answer_callback_query_json(const char *json) {
 
   struct mgos_telegram_request *request = mgos_telegram_request_alloc();
   request->method = ANSWER_CALLBACK_QUERY;
-  mg_asprintf(&request->json, 0, json);
+  mgos_telegram_request_set_json(request, json);
 
   LOG(LL_DEBUG, ("%s ->> %s %s", LIB_NAME, "Answer callback query ->>", request->json));
   bool is_added = mgos_telegram_request_queue_add(request);
@@ -781,17 +3019,18 @@ void mgos_telegram_answer_callback_query_json(const char *json) {
 }
 
 
-void mgos_telegram_execute_custom_method_with_callback(const char *method, const char *json, mgos_telegram_cb_t callback, void *userdata) {  
+void mgos_telegram_execute_custom_method_with_priority(const char *method, const char *json, enum mgos_telegram_priority priority, mgos_telegram_cb_t callback, void *userdata) {  
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
-  if (!tg || !tg->auth_token_tested) {
+  if (!mgos_telegram_can_queue()) {
     LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Telegram bot is not active, unable execute method"));
     return;
   }
 
   struct mgos_telegram_request *request = mgos_telegram_request_alloc();
   request->method = CUSTOM_METHOD;
-  mg_asprintf(&request->custom_method, 0, method);
-  mg_asprintf(&request->json, 0, json);
+  request->priority = priority;
+  mgos_telegram_request_set_method(request, method);
+  mgos_telegram_request_set_json(request, json);
   request->callback = callback;
   request->userdata = userdata;
   
@@ -803,9 +3042,72 @@ void mgos_telegram_execute_custom_method_with_callback(const char *method, const
   }
 }
 
-void mgos_telegram_execute_custom_method(const char *method, const char *json){
+bool mgos_telegram_send_file(int64_t chat_id, const char *method, const char *field, const char *path, const char *caption, mgos_telegram_cb_t callback, void *userdata) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
   if (!tg || !tg->auth_token_tested) {
+    LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Telegram bot is not active, unable send file"));
+    return false;
+  }
+  struct stat st;
+  if (method == NULL || field == NULL || path == NULL || stat(path, &st) != 0) {
+    LOG(LL_WARN, ("%s ->> Unable to send file %s", LIB_NAME, path != NULL ? path : ""));
+    return false;
+  }
+
+  // Parts before the file: chat_id, optional caption and the file part header
+  const char *name = strrchr(path, '/');
+  name = name != NULL ? name + 1 : path;
+  bool has_caption = caption != NULL && caption[0] != '\0';
+  char buf[256], *parts = buf;
+  mg_asprintf(&parts, sizeof(buf),
+    "--%s\r\nContent-Disposition: form-data; name=\"chat_id\"\r\n\r\n%lld\r\n"
+    "%s%s%s"
+    "--%s\r\nContent-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
+    "Content-Type: application/octet-stream\r\n\r\n",
+    UPLOAD_BOUNDARY, chat_id,
+    has_caption ? "--" UPLOAD_BOUNDARY "\r\nContent-Disposition: form-data; name=\"caption\"\r\n\r\n" : "",
+    has_caption ? caption : "", has_caption ? "\r\n" : "",
+    UPLOAD_BOUNDARY, field, name);
+
+  struct mgos_telegram_request *request = mgos_telegram_request_alloc();
+  request->method = CUSTOM_METHOD;
+  request->chat_id = chat_id;
+  mgos_telegram_request_set_method(request, method);
+  mgos_telegram_request_set_json(request, parts);
+  if (parts != buf) free(parts);
+  request->file = strdup(path);
+  request->callback = callback;
+  request->userdata = userdata;
+
+  LOG(LL_INFO, ("%s ->> Send file %s (%d bytes) by %s to chat %lld", LIB_NAME, path, (int) st.st_size, method, chat_id));
+  if (!mgos_telegram_request_queue_add(request)) {
+    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Error while sending file"));
+    mgos_telegram_request_free(request);
+    return false;
+  }
+  return true;
+}
+
+bool mgos_telegram_send_file_json(int64_t chat_id, const char *path, const char *json, mgos_telegram_cb_t callback, void *userdata) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  // Options come as one JSON object, mJS FFI can't pass more than 6 arguments
+  char *method = NULL, *field = NULL, *caption = NULL;
+  if (json != NULL) json_scanf(json, strlen(json), "{method: %Q, field: %Q, caption: %Q}", &method, &field, &caption);
+  bool success = mgos_telegram_send_file(chat_id, method != NULL ? method : "sendDocument", field != NULL ? field : "document", path, caption, callback, userdata);
+  free(method);
+  free(field);
+  free(caption);
+  return success;
+}
+
+void mgos_telegram_execute_custom_method_with_callback(const char *method, const char *json, mgos_telegram_cb_t callback, void *userdata) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  mgos_telegram_execute_custom_method_with_priority(method, json, PRIORITY_DEFAULT, callback, userdata);
+}
+
+void mgos_telegram_execute_custom_method(const char *method, const char *json){
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (!mgos_telegram_can_queue()) {
     LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Telegram bot is not active, unable execute method"));
     return;
   }
@@ -813,6 +3115,101 @@ void mgos_telegram_execute_custom_method(const char *method, const char *json){
 }
 
 
+int mgos_telegram_template_register(const char *method, const char *skeleton) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (!tg || method == NULL || skeleton == NULL) return -1;
+
+  struct mgos_telegram_template tpl;
+  struct mgos_telegram_template_arg args[TEMPLATE_ARGS_MAX];
+  memset(&tpl, 0, sizeof(tpl));
+  memset(args, 0, sizeof(args));
+  if (strcmp(method, "sendMessage") == 0) tpl.method = SEND_MESSAGE;
+  else if (strcmp(method, "editMessageText") == 0) tpl.method = EDIT_MESSAGE_TEXT;
+  else if (strcmp(method, "answerCallbackQuery") == 0) tpl.method = ANSWER_CALLBACK_QUERY;
+  else {
+    tpl.method = CUSTOM_METHOD;
+    tpl.custom_method = strdup(method);
+  }
+
+  // Offsets of template parts are 16 bit
+  bool ok = strlen(skeleton) <= UINT16_MAX;
+  if (!ok) LOG(LL_ERROR, ("%s ->> Template is longer than %d bytes", LIB_NAME, UINT16_MAX));
+
+  // Validate skeleton once, with empty values in place of placeholders
+  ok = ok && mgos_telegram_template_compile(&tpl, skeleton);
+  if (ok) {
+    for (int i = 0; i < tpl.parts_num - 1; i++) {
+      if (tpl.parts[i].type == 'Q') args[i].str = "";
+    }
+    char *sample = mgos_telegram_template_asprintf(&tpl, args, NULL, 0);
+    const char *p = sample;
+    while (isspace((unsigned char) *p)) p++;
+    ok = (*p == '{' && json_walk(sample, strlen(sample), NULL, NULL) > 0);
+    free(sample);
+    if (!ok) LOG(LL_ERROR, ("%s ->> Template is not valid JSON object: %s", LIB_NAME, skeleton));
+  }
+  if (!ok) {
+    free(tpl.custom_method);
+    free(tpl.literals);
+    free(tpl.parts);
+    return -1;
+  }
+
+  tg->templates = (struct mgos_telegram_template *) realloc(tg->templates, (tg->templates_num + 1) * sizeof(*tg->templates));
+  tg->templates[tg->templates_num] = tpl;
+  LOG(LL_INFO, ("%s ->> Template %d registered for %s", LIB_NAME, tg->templates_num, method));
+  return tg->templates_num++;
+}
+
+bool mgos_telegram_send_template_with_callback(int id, mgos_telegram_cb_t callback, void *userdata, ...) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (!mgos_telegram_template_check_id(id)) return false;
+
+  struct mgos_telegram_template_arg args[TEMPLATE_ARGS_MAX];
+  va_list ap;
+  va_start(ap, userdata);
+  mgos_telegram_template_args_va(&tg->templates[id], args, ap);
+  va_end(ap);
+  return mgos_telegram_template_send(id, args, callback, userdata);
+}
+
+bool mgos_telegram_send_template(int id, ...) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (!mgos_telegram_template_check_id(id)) return false;
+
+  struct mgos_telegram_template_arg args[TEMPLATE_ARGS_MAX];
+  va_list ap;
+  va_start(ap, id);
+  mgos_telegram_template_args_va(&tg->templates[id], args, ap);
+  va_end(ap);
+  return mgos_telegram_template_send(id, args, NULL, NULL);
+}
+
+bool mgos_telegram_send_template_json_with_callback(int id, const char *args_json, mgos_telegram_cb_t callback, void *userdata) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  if (!mgos_telegram_template_check_id(id)) return false;
+
+  struct mgos_telegram_template_arg args[TEMPLATE_ARGS_MAX];
+  struct mgos_telegram_template_parser parser = {
+    .tpl = &tg->templates[id],
+    .args = args,
+    .count = 0,
+    .error = false,
+  };
+  if (args_json == NULL || json_walk(args_json, strlen(args_json), mgos_telegram_template_args_walk_cb, &parser) <= 0 ||
+      parser.error || parser.count != parser.tpl->parts_num - 1) {
+    LOG(LL_ERROR, ("%s ->> Template %d expects array of %d arguments", LIB_NAME, id, parser.tpl->parts_num - 1));
+    return false;
+  }
+  return mgos_telegram_template_send(id, args, callback, userdata);
+}
+
+bool mgos_telegram_send_template_json(int id, const char *args_json) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  return mgos_telegram_send_template_json_with_callback(id, args_json, NULL, NULL);
+}
+
+
 // LIB INIT FN
 static void mgos_telegram_close_all_connections(void) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
@@ -820,26 +3217,21 @@ static void mgos_telegram_close_all_connections(void) {
   if (!tg->auth_token_tested) return;
   // Otherwise reset token tested flag
   tg->auth_token_tested = false;
-  // Stop all timers
-  if (tg->update_queue_timer != MGOS_INVALID_TIMER_ID) {
-    mgos_clear_timer(tg->update_queue_timer);
-    tg->update_queue_timer = MGOS_INVALID_TIMER_ID;
-  }
-  if (tg->request_queue_timer != MGOS_INVALID_TIMER_ID) {
-    mgos_clear_timer(tg->request_queue_timer);
-    tg->request_queue_timer = MGOS_INVALID_TIMER_ID;
-  }
   // Close all active connections
   if (tg->nc_poll != NULL) {
     tg->nc_poll->flags |= MG_F_CLOSE_IMMEDIATELY;
     tg->nc_poll = NULL;
     tg->poll_connected = false;
   }
-  if (tg->nc_out != NULL) {
-    tg->nc_out->flags |= MG_F_CLOSE_IMMEDIATELY;
-    tg->nc_out = NULL;
-    tg->out_connected = false;
+  for (int i = 0; i < tg->conns_num; i++) {
+    struct mgos_telegram_conn *conn = &tg->conns[i];
+    if (conn->nc == NULL) continue;
+    conn->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    conn->nc = NULL;
+    if (conn->request != NULL) conn->request->conn = NULL;
+    conn->request = NULL;
   }
+  mgos_telegram_conn_update_stats();
   // Trigger TGB_EV_DISCONNECTED event
   mgos_event_trigger(TGB_EV_DISCONNECTED, NULL);
 }
@@ -849,23 +3241,74 @@ static void mgos_telegram_check_token(void) {
   LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Testing telegram token"));
 
   struct mgos_telegram_request *request;
-  
-  // Check if GET_ME request is already in the head of the queue
-  if (!STAILQ_EMPTY(&tg->request_queue)) {
-    request = STAILQ_FIRST(&tg->request_queue);
-    if (request->method == GET_ME) {
-      mgos_set_timer(3000, 0, mgos_telegram_request_queue_handler, NULL);
-      return;
-    }
+  bool queued = false;
+
+  // Check if GET_ME request is already in the queue
+  STAILQ_FOREACH(request, &tg->request_queue, next) {
+    if (request->method == GET_ME) queued = true;
   }
   // Otherwise generate new GET_ME request
-  request = mgos_telegram_request_alloc();
-  request->method = GET_ME;
-  request->callback = mgos_telegram_connection_cb;
-  request->userdata = NULL;
-  // And insert it in the head of the queue
-  STAILQ_INSERT_HEAD(&tg->request_queue, request, next);
-  mgos_set_timer(3000, 0, mgos_telegram_request_queue_handler, NULL);
+  if (!queued) {
+    request = mgos_telegram_request_alloc();
+    request->method = GET_ME;
+    request->callback = mgos_telegram_connection_cb;
+    request->userdata = NULL;
+    // Control priority puts it in front of all other requests, limits are bypassed
+    mgos_telegram_request_queue_insert(request);
+  }
+  // First test goes immediately, next ones use retry backoff
+  if (tg->token_timer != MGOS_INVALID_TIMER_ID) return;
+  int delay = tg->token_checks > 0 ? (int) (mgos_telegram_retry_backoff(tg->token_checks) * 1000) : 0;
+  tg->token_checks++;
+  tg->stats.token_checks++;
+  tg->token_timer = mgos_set_timer(delay, 0, mgos_telegram_check_token_cb, NULL);
+}
+
+static void mgos_telegram_check_token_cb(void *userdata) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  tg->token_timer = MGOS_INVALID_TIMER_ID;
+  // GET_ME may be queued behind other control requests (e.g. setWebhook)
+  struct mgos_telegram_request *request;
+  STAILQ_FOREACH(request, &tg->request_queue, next) {
+    if (request->method == GET_ME) break;
+  }
+  // In flight GET_ME is completed by its reply or retried on failure
+  if (request != NULL && request->conn != NULL) return;
+  if (request == NULL && tg->auth_token_tested) return;
+  // Request pump is stopped until token is tested, so send GET_ME directly
+  struct mgos_telegram_conn *conn = mgos_telegram_conn_get_free();
+  if (request == NULL || conn == NULL) {
+    mgos_telegram_check_token();
+    return;
+  }
+  mgos_telegram_http_send_request(conn, request);
+  (void) userdata;
+}
+
+static void mgos_telegram_token_rejected(void) {
+  // Token validated before is not trusted anymore, test it again with getMe
+  LOG(LL_WARN, ("%s ->> %s", LIB_NAME, "Server rejected the token"));
+  tg->auth_token_valid = false;
+  mgos_telegram_close_all_connections();
+  mgos_telegram_check_token();
+}
+
+static void mgos_telegram_set_active(void) {
+  if (tg->cfg->webhook && !tg->webhook_set) {
+    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Registering webhook"));
+    tg->webhook_set = true;
+    mgos_telegram_webhook_request("setWebhook");
+  }
+  if (mgos_telegram_http_poll_wanted()) {
+    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Starting update handler"));
+    mgos_telegram_http_poll_once();
+  }
+  LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Telegram bot is active"));
+  tg->auth_token_tested = true;
+  // Dispatch updates and send requests queued before the connection was lost
+  mgos_telegram_update_queue_kick();
+  mgos_telegram_request_queue_kick();
+  mgos_event_trigger(TGB_EV_CONNECTED, NULL);
 }
 
 static void mgos_telegram_network_cb(int ev, void *ev_data, void *userdata) {
@@ -874,6 +3317,13 @@ static void mgos_telegram_network_cb(int ev, void *ev_data, void *userdata) {
   switch (ev) {
     case MGOS_NET_EV_IP_ACQUIRED: {
       mgos_telegram_close_all_connections();
+      // Token validated in this boot is trusted, so queued requests and polling resume at once
+      if (tg->cfg->fast_reconnect && tg->auth_token_valid) {
+        LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Fast reconnect, token is already validated"));
+        tg->stats.fast_reconnects++;
+        mgos_telegram_set_active();
+        break;
+      }
       mgos_telegram_check_token();
       break;
     }
@@ -896,15 +3346,9 @@ static void mgos_telegram_connection_cb(void *ev_data, void *userdata) {
 
   if (response->ok) {
     LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Testing auth token successful"));
-    tg->request_queue_timer = mgos_set_timer(500, MGOS_TIMER_REPEAT, mgos_telegram_request_queue_handler, NULL);
-    if ( !SLIST_EMPTY(&tg->subscriptions) || tg->cfg->echo_bot) {
-      LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Starting update handler"));
-      tg->update_queue_timer = mgos_set_timer(500, MGOS_TIMER_REPEAT, mgos_telegram_update_queue_handler, NULL);
-      mgos_telegram_http_poll_once();
-    }
-    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Telegram bot is active"));
-    tg->auth_token_tested = true;
-    mgos_event_trigger(TGB_EV_CONNECTED, NULL);
+    tg->auth_token_valid = true;
+    tg->token_checks = 0;
+    mgos_telegram_set_active();
   }
   else {
     LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Testing auth token unsuccessful, check token or internet connection issues"));
@@ -924,16 +3368,53 @@ bool mgos_telegram_check_config(const struct mgos_config_telegram *cfg) {
   return success;
 }
 
+static bool mgos_telegram_parse_server(struct mgos_telegram *tg, const char *server) {
+  LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
+  struct mg_str scheme, user_info, host, path, query, fragment;
+  unsigned int port = 0;
+
+  if (mg_parse_uri(mg_mk_str(server), &scheme, &user_info, &host, &port, &path, &query, &fragment) != 0 ||
+      host.len == 0) {
+    return false;
+  }
+  tg->server_ssl = (mg_vcasecmp(&scheme, "https") == 0);
+  if (port == 0) port = tg->server_ssl ? 443 : 80;
+  // Strip trailing slash, the request path is <path>/bot<token>/<method>
+  if (path.len > 0 && path.p[path.len - 1] == '/') path.len--;
+
+  mg_asprintf(&tg->server_host, 0, "%.*s", (int) host.len, host.p);
+  mg_asprintf(&tg->server_addr, 0, "%.*s:%u", (int) host.len, host.p, port);
+  // Constant parts of every request line are built once
+  mg_asprintf(&tg->http_prefix, 0, "%.*s/bot%s/", (int) path.len, path.p, tg->cfg->token);
+  mg_asprintf(&tg->http_host, 0, " HTTP/1.1\r\nHost: %.*s\r\n", (int) host.len, host.p);
+  return true;
+}
+
 static struct mgos_telegram *mgos_telegram_create(const struct mgos_config_telegram *cfg) {
   LOG(LL_DEBUG, ("%s ->> %s", LIB_NAME, __FUNCTION__));
   if (!mgos_telegram_check_config(cfg)) return NULL;
   struct mgos_telegram *tg = (struct mgos_telegram *) calloc(1, sizeof(*tg));
   tg->cfg = cfg;
+  if (!mgos_telegram_parse_server(tg, cfg->server)) {
+    LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Configuration Error, unable to parse telegram.server"));
+    free(tg);
+    return NULL;
+  }
   tg->auth_token_tested = false;
   STAILQ_INIT(&tg->update_queue);
+  STAILQ_INIT(&tg->update_pending);
   STAILQ_INIT(&tg->request_queue);
-  tg->update_queue_timer = MGOS_INVALID_TIMER_ID;
-  tg->request_queue_timer = MGOS_INVALID_TIMER_ID;
+  mgos_telegram_slabs_init(tg);
+  tg->conns_num = cfg->pool_size > 0 ? cfg->pool_size : 1;
+  tg->conns_max = cfg->pool_per_host > 0 && cfg->pool_per_host < tg->conns_num ? cfg->pool_per_host : tg->conns_num;
+  tg->conns = (struct mgos_telegram_conn *) calloc(tg->conns_num, sizeof(*tg->conns));
+  tg->stats.pool_size = tg->conns_max;
+  mbuf_init(&tg->poll_stream.buf, tg->update_slab != NULL ? tg->text_size + UPDATE_FIELDS_SIZE : 0);
+  tg->poll_stream.state = STREAM_DONE;
+  mgos_telegram_acl_build(tg);
+  mgos_telegram_offset_restore(tg);
+  mgos_telegram_spool_init(tg);
+  if (cfg->webhook) mgos_telegram_webhook_listen(tg);
   mgos_event_register_base(MGOS_EVENT_TGB, "Telegram bot events");
   mgos_event_add_group_handler(MGOS_EVENT_GRP_NET, mgos_telegram_network_cb, NULL);
   LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Waiting for internet connection"));
@@ -951,5 +3432,8 @@ bool mgos_telegram_init(void) {
   if (!tg) {
     LOG(LL_INFO, ("%s ->> %s", LIB_NAME, "Initializing telegram bot library unsuccessful"));
   }
+#ifdef MGOS_HAVE_RPC_COMMON
+  mg_rpc_add_handler(mgos_rpc_get_global(), "Telegram.Stats", "{reset: %B}", mgos_telegram_rpc_stats_handler, NULL);
+#endif
   return true;
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+/*
+ * 2025 Aleksey A. Kotelnikov <kotelnikov.www@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "common/queue.h"
+#include "mgos_event.h"
+#include "mgos_telegram_parse.h"
+
+// Parsers walk the JSON once with json_walk() and pick fields by their path,
+// instead of calling json_scanf() for every field from the beginning
+struct mgos_telegram_update_parser {
+  bool batch;
+  struct mgos_telegram_update *update;
+  struct update_queue *updates;
+  int count;
+};
+
+int64_t mgos_telegram_json_to_int(const struct json_token *t) {
+  int64_t value = 0;
+  int i = 0;
+  bool negative = (t->len > 0 && t->ptr[0] == '-');
+  if (negative) i++;
+  for (; i < t->len && t->ptr[i] >= '0' && t->ptr[i] <= '9'; i++) {
+    value = value * 10 + (t->ptr[i] - '0');
+  }
+  return negative ? -value : value;
+}
+
+void mgos_telegram_json_to_str(const struct json_token *t, char **dest, char *buf, size_t size) {
+  // Unescaped string is never longer than escaped one, use buf if it fits
+  if (*dest != NULL && *dest != buf) free(*dest);
+  *dest = (buf != NULL && (size_t) t->len < size) ? buf : (char *) malloc(t->len + 1);
+  int len = json_unescape(t->ptr, t->len, *dest, t->len + 1);
+  if (len < 0) {
+    if (*dest != buf) free(*dest);
+    *dest = NULL;
+    return;
+  }
+  (*dest)[len] = '\0';
+}
+
+static void mgos_telegram_update_walk_cb(void *data, const char *name, size_t name_len, const char *path, const struct json_token *t) {
+  struct mgos_telegram_update_parser *parser = (struct mgos_telegram_update_parser *) data;
+  const char *field = path;
+
+  // In getUpdates reply updates are elements of .result array, strip ".result[N]"
+  if (parser->batch) {
+    if (strncmp(path, ".result[", 8) != 0) return;
+    field = strchr(path + 8, ']');
+    if (field == NULL) return;
+    field++;
+  }
+
+  // Update object itself
+  if (field[0] == '\0') {
+    if (t->type == JSON_TYPE_OBJECT_START && parser->update == NULL) {
+      parser->update = mgos_telegram_update_alloc();
+    }
+    else if (t->type == JSON_TYPE_OBJECT_END && parser->update != NULL) {
+      struct mgos_telegram_update *update = parser->update;
+      parser->update = NULL;
+      if (update->update_id == 0) {
+        mgos_telegram_update_free(update);
+        return;
+      }
+      if ((update->type == MESSAGE || update->type == CALLBACK_QUERY) && update->data == NULL) {
+        mgos_telegram_update_set_str(update, &update->data, NULL, "Unsupported characters");
+      }
+      STAILQ_INSERT_TAIL(parser->updates, update, next);
+      parser->count++;
+    }
+    return;
+  }
+
+  struct mgos_telegram_update *update = parser->update;
+  if (update == NULL) return;
+
+  if (t->type == JSON_TYPE_NUMBER) {
+    if (strcmp(field, ".update_id") == 0) {
+      update->update_id = (uint32_t) mgos_telegram_json_to_int(t);
+    }
+    else if (strcmp(field, ".message.message_id") == 0) {
+      update->message_id = (uint32_t) mgos_telegram_json_to_int(t);
+      if (update->message_id > 0) update->type = MESSAGE;
+    }
+    else if (strcmp(field, ".message.chat.id") == 0) {
+      update->chat_id = mgos_telegram_json_to_int(t);
+    }
+    else if (strcmp(field, ".message.from.id") == 0 || strcmp(field, ".callback_query.from.id") == 0) {
+      update->user_id = (uint64_t) mgos_telegram_json_to_int(t);
+    }
+    else if (strcmp(field, ".callback_query.message.chat.id") == 0) {
+      update->chat_id = mgos_telegram_json_to_int(t);
+    }
+    else if (strcmp(field, ".callback_query.message.message_id") == 0) {
+      update->message_id = (uint32_t) mgos_telegram_json_to_int(t);
+    }
+  }
+  else if (t->type == JSON_TYPE_STRING) {
+    if (strcmp(field, ".message.text") == 0 || strcmp(field, ".callback_query.data") == 0) {
+      mgos_telegram_update_set_str(update, &update->data, t, NULL);
+    }
+    else if (strcmp(field, ".callback_query.id") == 0) {
+      mgos_telegram_update_set_str(update, &update->query_id, t, NULL);
+      if (update->type == NO_TYPE) update->type = CALLBACK_QUERY;
+    }
+  }
+
+  (void) name;
+  (void) name_len;
+}
+
+int mgos_telegram_parse_updates(const char *json, size_t len, bool batch, struct update_queue *updates) {
+  struct mgos_telegram_update_parser parser = {
+    .batch = batch,
+    .update = NULL,
+    .updates = updates,
+    .count = 0,
+  };
+
+  json_walk(json, len, mgos_telegram_update_walk_cb, &parser);
+  // Truncated JSON leaves unfinished update
+  if (parser.update != NULL) mgos_telegram_update_free(parser.update);
+
+  return parser.count;
+}
@@ -0,0 +1,46 @@
+/*
+ * 2025 Aleksey A. Kotelnikov <kotelnikov.www@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Internal header: the update parser shared by the library and bench/parse_bench.c
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "frozen.h"
+#include "mgos_telegram.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+STAILQ_HEAD(update_queue, mgos_telegram_update);
+
+// Provided by the library, the benchmark has its own heap-only versions
+struct mgos_telegram_update *mgos_telegram_update_alloc(void);
+void mgos_telegram_update_free(struct mgos_telegram_update *update);
+void mgos_telegram_update_set_str(struct mgos_telegram_update *update, char **dest, const struct json_token *t, const char *str);
+
+int64_t mgos_telegram_json_to_int(const struct json_token *t);
+void mgos_telegram_json_to_str(const struct json_token *t, char **dest, char *buf, size_t size);
+
+// Appends parsed updates to the queue: batch - getUpdates reply, otherwise a single update object
+int mgos_telegram_parse_updates(const char *json, size_t len, bool batch, struct update_queue *updates);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */